@@ -0,0 +1,365 @@
+#include "client.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "server.h"
+#include "shared_memory.h"
+
+struct Client {
+  // nothing goes over the socket once the rings are set up; the server
+  // just closing it tells us it's gone
+  int socket_fd;
+  SharedRing requests;
+  SharedRing responses;
+  int request_event_fd;
+  int response_event_fd;
+  // frames in the ring aren't aligned, so batches are copied here before
+  // their columns are handed out as arrays
+  uint64_t *batch_buffer;
+  size_t batch_buffer_size;
+};
+
+// reads the server's RESPONSE_SHARED_MEMORY frame and the three fds that
+// come with it
+bool receive_shared_memory(int socket_fd, int fds[3]) {
+  char frame[FRAME_HEADER_SIZE];
+  struct iovec iov = {frame, FRAME_HEADER_SIZE};
+  char control[CMSG_SPACE(3 * sizeof(int))];
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+
+  ssize_t received = recvmsg(socket_fd, &message, MSG_WAITALL);
+  struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+  if (received != FRAME_HEADER_SIZE || frame[4] != RESPONSE_SHARED_MEMORY ||
+      header == NULL || header->cmsg_type != SCM_RIGHTS ||
+      header->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+    return false;
+  }
+  memcpy(fds, CMSG_DATA(header), 3 * sizeof(int));
+  return true;
+}
+
+Client *client_connect(const char *socket_path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    return NULL;
+  }
+  strcpy(address.sun_path, socket_path);
+
+  int socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (socket_fd == -1) {
+    return NULL;
+  }
+
+  char request[FRAME_HEADER_SIZE];
+  put_u32(request, 1);
+  request[4] = REQUEST_SHARED_MEMORY;
+  int fds[3];
+  if (connect(socket_fd, (struct sockaddr *)&address, sizeof(address)) ==
+          -1 ||
+      send(socket_fd, request, FRAME_HEADER_SIZE, MSG_NOSIGNAL) !=
+          FRAME_HEADER_SIZE ||
+      !receive_shared_memory(socket_fd, fds)) {
+    close(socket_fd);
+    return NULL;
+  }
+
+  Client *client = malloc(sizeof(Client));
+  client->socket_fd = socket_fd;
+  client->batch_buffer = NULL;
+  client->batch_buffer_size = 0;
+  client->request_event_fd = fds[1];
+  client->response_event_fd = fds[2];
+  bool is_mapped =
+      map_shared_rings(fds[0], &client->requests, &client->responses);
+  close(fds[0]);
+  if (!is_mapped) {
+    close(fds[1]);
+    close(fds[2]);
+    close(socket_fd);
+    free(client);
+    return NULL;
+  }
+  return client;
+}
+
+void client_close(Client *client) {
+  unmap_shared_rings(&client->requests, &client->responses);
+  close(client->request_event_fd);
+  close(client->response_event_fd);
+  close(client->socket_fd);
+  free(client->batch_buffer);
+  free(client);
+}
+
+// sleeps until the server pokes us. false if it hung up instead
+bool wait_for_server(Client *client) {
+  struct pollfd fds[2];
+  fds[0].fd = client->response_event_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = client->socket_fd;
+  fds[1].events = POLLIN;
+  if (poll(fds, 2, -1) == -1 || fds[1].revents != 0) {
+    return false;
+  }
+
+  uint64_t count;
+  (void)!read(client->response_event_fd, &count, sizeof(count));
+  return true;
+}
+
+bool write_request(Client *client, const char *data, size_t length) {
+  while (true) {
+    size_t written = ring_write(&client->requests, data, length);
+    data += written;
+    length -= written;
+    signal_event(client->request_event_fd);
+    if (length == 0) {
+      return true;
+    }
+    if (!wait_for_server(client)) {
+      return false;
+    }
+  }
+}
+
+// copies a RESPONSE_ROW payload into `row`. false if it's malformed
+bool read_row(const char *payload, size_t length, Row *row) {
+  if (length < 6) {
+    return false;
+  }
+  row->id = get_u32(payload);
+  uint8_t username_length = payload[4];
+  if (username_length > COLUMN_USERNAME_SIZE ||
+      6 + (size_t)username_length > length) {
+    return false;
+  }
+  uint8_t email_length = payload[5 + username_length];
+  if (6 + (size_t)username_length + email_length != length) {
+    return false;
+  }
+
+  memcpy(row->username, payload + 5, username_length);
+  row->username[username_length] = '\0';
+  memcpy(row->email, payload + 6 + username_length, email_length);
+  row->email[email_length] = '\0';
+  return true;
+}
+
+// checks one string column of a batch and points `offsets` and `bytes` at
+// it. Returns where the next buffer starts, or NULL if it doesn't add up
+const char *read_string_column(const char *column, const char *end,
+                               uint32_t num_rows, const int32_t **offsets,
+                               const char **bytes) {
+  size_t offsets_size = (4 * ((size_t)num_rows + 1) + 7) & ~(size_t)7;
+  if ((size_t)(end - column) < offsets_size) {
+    return NULL;
+  }
+  *offsets = (const int32_t *)column;
+  *bytes = column + offsets_size;
+
+  for (uint32_t i = 0; i < num_rows; i++) {
+    if ((*offsets)[i + 1] < (*offsets)[i]) {
+      return NULL;
+    }
+  }
+  size_t bytes_size = ((size_t)(*offsets)[num_rows] + 7) & ~(size_t)7;
+  if ((*offsets)[0] != 0 || (size_t)(end - *bytes) < bytes_size) {
+    return NULL;
+  }
+  return *bytes + bytes_size;
+}
+
+// copies a RESPONSE_BATCH payload somewhere aligned and points `batch` at
+// its columns. false if it's malformed
+bool read_batch(Client *client, const char *payload, size_t length,
+                ColumnBatch *batch) {
+  if (length < 8) {
+    return false;
+  }
+  if (client->batch_buffer_size < length) {
+    free(client->batch_buffer);
+    client->batch_buffer = malloc(length);
+    client->batch_buffer_size = length;
+  }
+  memcpy(client->batch_buffer, payload, length);
+
+  // like Arrow, the buffers are little-endian and used as they are
+  const char *data = (const char *)client->batch_buffer;
+  const char *end = data + length;
+  batch->num_rows = get_u32(data);
+  size_t ids_size = (4 * (size_t)batch->num_rows + 7) & ~(size_t)7;
+  if (batch->num_rows > ROW_BATCH_SIZE || length - 8 < ids_size) {
+    return false;
+  }
+  batch->ids = (const uint32_t *)(data + 8);
+
+  const char *column = data + 8 + ids_size;
+  column = read_string_column(column, end, batch->num_rows,
+                              &batch->username_offsets, &batch->usernames);
+  if (column == NULL) {
+    return false;
+  }
+  return read_string_column(column, end, batch->num_rows,
+                            &batch->email_offsets, &batch->emails) != NULL;
+}
+
+/*
+ * Sends one statement and reads back its answer. Rows come either one at a
+ * time to `on_row` or, with REQUEST_STATEMENT_COLUMNAR, in batches to
+ * `on_batch`.
+ */
+ClientResult run_request(Client *client, RequestType type, const char *sql,
+                         size_t sql_length,
+                         void (*on_row)(const Row *row, void *context),
+                         void (*on_batch)(const ColumnBatch *batch,
+                                          void *context),
+                         void *context, char *error_message) {
+  // the whole frame has to fit in the ring for the server to run it
+  if (FRAME_HEADER_SIZE + sql_length > SHARED_RING_SIZE) {
+    strcpy(error_message, "String is too long.");
+    return CLIENT_ERROR;
+  }
+
+  char header[FRAME_HEADER_SIZE];
+  put_u32(header, sql_length + 1);
+  header[4] = type;
+  if (!write_request(client, header, FRAME_HEADER_SIZE) ||
+      !write_request(client, sql, sql_length)) {
+    return CLIENT_DISCONNECTED;
+  }
+
+  // responses are read in place in the ring, one frame at a time
+  while (true) {
+    size_t available;
+    const char *frame = ring_read_pointer(&client->responses, &available);
+    if (available >= FRAME_HEADER_SIZE &&
+        (get_u32(frame) == 0 || get_u32(frame) > MAX_FRAME_SIZE)) {
+      // the server would never send this
+      return CLIENT_DISCONNECTED;
+    }
+    if (available < FRAME_HEADER_SIZE ||
+        available < 4 + (size_t)get_u32(frame)) {
+      if (!wait_for_server(client)) {
+        return CLIENT_DISCONNECTED;
+      }
+      continue;
+    }
+
+    size_t frame_length = 4 + (size_t)get_u32(frame);
+    const char *payload = frame + FRAME_HEADER_SIZE;
+    size_t payload_length = frame_length - FRAME_HEADER_SIZE;
+    bool is_last = true;
+    ClientResult result = CLIENT_SUCCESS;
+    switch (frame[4]) {
+    case (RESPONSE_ROW): {
+      Row row;
+      if (on_row != NULL && read_row(payload, payload_length, &row)) {
+        on_row(&row, context);
+      }
+      is_last = false;
+      break;
+    }
+    case (RESPONSE_BATCH): {
+      ColumnBatch batch;
+      if (on_batch != NULL &&
+          read_batch(client, payload, payload_length, &batch)) {
+        on_batch(&batch, context);
+      }
+      is_last = false;
+      break;
+    }
+    case (RESPONSE_DONE):
+      break;
+    case (RESPONSE_ERROR):
+      if (payload_length >= CLIENT_ERROR_MESSAGE_SIZE) {
+        payload_length = CLIENT_ERROR_MESSAGE_SIZE - 1;
+      }
+      memcpy(error_message, payload, payload_length);
+      error_message[payload_length] = '\0';
+      result = CLIENT_ERROR;
+      break;
+    default:
+      // not something a statement gets back; skip it
+      is_last = false;
+      break;
+    }
+
+    // the server may be stuck waiting for the room we've just made
+    if (ring_consume(&client->responses, frame_length)) {
+      signal_event(client->request_event_fd);
+    }
+    if (is_last) {
+      return result;
+    }
+  }
+}
+
+ClientResult client_execute(Client *client, const char *sql,
+                            size_t sql_length,
+                            void (*on_row)(const Row *row, void *context),
+                            void *context, char *error_message) {
+  return run_request(client, REQUEST_STATEMENT, sql, sql_length, on_row, NULL,
+                     context, error_message);
+}
+
+ClientResult client_execute_columnar(
+    Client *client, const char *sql, size_t sql_length,
+    void (*on_batch)(const ColumnBatch *batch, void *context), void *context,
+    char *error_message) {
+  return run_request(client, REQUEST_STATEMENT_COLUMNAR, sql, sql_length,
+                     NULL, on_batch, context, error_message);
+}
+
+#else
+
+// the server side needs Linux, so there's nothing to connect to elsewhere
+Client *client_connect(const char *socket_path) {
+  (void)socket_path;
+  return NULL;
+}
+
+void client_close(Client *client) { (void)client; }
+
+ClientResult client_execute(Client *client, const char *sql,
+                            size_t sql_length,
+                            void (*on_row)(const Row *row, void *context),
+                            void *context, char *error_message) {
+  (void)client;
+  (void)sql;
+  (void)sql_length;
+  (void)on_row;
+  (void)context;
+  (void)error_message;
+  return CLIENT_DISCONNECTED;
+}
+
+ClientResult client_execute_columnar(
+    Client *client, const char *sql, size_t sql_length,
+    void (*on_batch)(const ColumnBatch *batch, void *context), void *context,
+    char *error_message) {
+  (void)client;
+  (void)sql;
+  (void)sql_length;
+  (void)on_batch;
+  (void)context;
+  (void)error_message;
+  return CLIENT_DISCONNECTED;
+}
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include "db.h"
+
+/*
+ * Client side of server mode for programs on the same machine as the
+ * server. It asks for the shared memory transport right after connecting,
+ * so statements and their results never go through the socket (see
+ * server.h).
+ */
+typedef struct Client Client;
+
+typedef enum {
+  CLIENT_SUCCESS,
+  CLIENT_ERROR,
+  CLIENT_DISCONNECTED
+} ClientResult;
+
+/*
+ * A batch of select results in columns, as sent by the server (see
+ * RESPONSE_BATCH in server.h). Row i's username is the
+ * username_offsets[i + 1] - username_offsets[i] bytes at
+ * usernames + username_offsets[i]; it isn't null-terminated. Likewise for
+ * emails.
+ *
+ * Everything is only good until the callback it was passed to returns.
+ */
+typedef struct {
+  uint32_t num_rows;
+  const uint32_t *ids;
+  const int32_t *username_offsets;
+  const char *usernames;
+  const int32_t *email_offsets;
+  const char *emails;
+} ColumnBatch;
+
+// room for any error message the server sends back
+#define CLIENT_ERROR_MESSAGE_SIZE 256
+
+// NULL if there's no server on `socket_path` or it won't share memory
+Client *client_connect(const char *socket_path);
+void client_close(Client *client);
+
+/*
+ * Runs one statement on the server, calling `on_row` for each row it
+ * returns. On CLIENT_ERROR the server's message is copied into
+ * `error_message`.
+ */
+ClientResult client_execute(Client *client, const char *sql,
+                            size_t sql_length,
+                            void (*on_row)(const Row *row, void *context),
+                            void *context, char *error_message);
+
+// like client_execute, but a select's rows come a ColumnBatch at a time
+ClientResult client_execute_columnar(
+    Client *client, const char *sql, size_t sql_length,
+    void (*on_batch)(const ColumnBatch *batch, void *context), void *context,
+    char *error_message);
+
+#endif
@@ -0,0 +1,4088 @@
+#include "db.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/*
+ * TLDR: this is a utility macro to get the byte size of a specific attribute
+ * within struct without needing to create an actual instance of the struct.
+ *
+ * "hey compiler, if this were a real Struct pointer, I want to access
+ * Attribute"
+ *
+ * Breakdown:
+ * - Struct*                    creates a pointer
+ * - (Struct*)0                 creates a NULL pointer by casting a 0, since 0
+ * is not a valid memory address
+ * - ((Struct *)0)->Attribute   gets the Attribute type info from Struct through
+ * a NULL pointer
+ *
+ * */
+#define size_of_attribute(Struct, Attribute) sizeof(((Struct *)0)->Attribute)
+
+const uint32_t ID_SIZE = size_of_attribute(Row, id);             // 4 bytes
+const uint32_t USERNAME_SIZE = size_of_attribute(Row, username); // 32 bytes
+const uint32_t EMAIL_SIZE = size_of_attribute(Row, email);       // 255 bytes
+const uint32_t ID_OFFSET = 0;
+const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
+const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
+const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
+
+/*
+ * Serialization is the process of converting a data structure
+ * (in this case a Row struct) into a format that can be stored
+ * or transmitted (a contiguous memory block)
+ *
+ * Each memcpy call copies the specific Row instance's field to a predetermined
+ * location in the destination memory block
+ */
+void serialize_row(Row *row_byte_address, void *row_location_in_page) {
+  /*
+   * memcp copies n chars from src to dest.
+   *
+   * void *memcpy(void *dst, const void *src, size_t n)
+   * ^^ notice the `const void *src` syntax
+   * `const` is a hint that *src shouldn't be modified.
+   *
+   * memcpy(destination address, source address to copy bytes from, number of
+   * bytes to copy)
+   */
+
+  // being painfully explicity here
+  uint32_t *row_id_position = (uint32_t *)(row_location_in_page + ID_OFFSET);
+  memcpy(row_id_position, &(row_byte_address->id), ID_SIZE);
+
+  memcpy(row_location_in_page + USERNAME_OFFSET, &(row_byte_address->username),
+         USERNAME_SIZE);
+  memcpy(row_location_in_page + EMAIL_OFFSET, &(row_byte_address->email),
+         EMAIL_SIZE);
+}
+
+/*
+ * Reverses the serialization process by copying bytes from a memory block
+ * back into a structured Row object, using predefined offsets to locate
+ * each field's original position in the sorted memory block
+ */
+void deserialize_row(void *row_byte_address, Row *row_location_in_page) {
+  memcpy(&(row_location_in_page->id), row_byte_address + ID_OFFSET, ID_SIZE);
+  memcpy(&(row_location_in_page->username), row_byte_address + USERNAME_OFFSET,
+         USERNAME_SIZE);
+  memcpy(&(row_location_in_page->email), row_byte_address + EMAIL_OFFSET,
+         EMAIL_SIZE);
+}
+
+// Table structure that points to pages of rows and keeps tracks of how many
+// rows there are in prepare_statement
+
+// 4KB; equivalent to a page in most VMs.
+// This way 1 page in our DB is 1 page in the OS, so it's treated as a single
+// unit
+const uint32_t PAGE_SIZE = 4096;
+#define TABLE_MAX_PAGES 100
+const uint32_t ROWS_PER_PAGE = PAGE_SIZE / ROW_SIZE;
+const uint32_t TABLE_MAX_ROWS = ROWS_PER_PAGE * TABLE_MAX_PAGES;
+
+/*
+ * Deleted rows aren't removed, they're "tombstoned": every page ends with a
+ * bitmap where bit i set means row slot i on that page is dead.
+ *
+ * 13 rows * 293 bytes = 3809 bytes, so the bitmap (2 bytes) fits in the space
+ * that was already left over at the end of each page.
+ */
+const uint32_t TOMBSTONE_BITMAP_SIZE = (ROWS_PER_PAGE + 7) / 8;
+const uint32_t TOMBSTONE_BITMAP_OFFSET = PAGE_SIZE - TOMBSTONE_BITMAP_SIZE;
+
+/*
+ * Every row slot is one version of a row (MVCC): it carries the commit
+ * stamp that created it and the one that ended it (by a delete, or an
+ * update writing a newer version somewhere else), 0 if it's still current.
+ *
+ * A scan takes the latest commit stamp as its snapshot when it starts, and
+ * sees exactly the versions created at or before it and not ended by then
+ * (see is_version_visible), however the table changes while it runs. No
+ * locks: the writer never overwrites a version a snapshot can still see.
+ * An ended version stays put until no snapshot needs it, then its slot is
+ * tombstoned like any deleted row (see collect_garbage).
+ *
+ * The stamps live in the leftover space too, 8-byte aligned after the rows:
+ * 13 begin stamps then 13 end stamps, 208 bytes ending well before the
+ * bitmap.
+ */
+const uint32_t BEGIN_STAMPS_OFFSET = (ROWS_PER_PAGE * ROW_SIZE + 7) & ~7;
+const uint32_t END_STAMPS_OFFSET =
+    BEGIN_STAMPS_OFFSET + ROWS_PER_PAGE * sizeof(uint64_t);
+// a snapshot that sees every current version, committed or not
+#define LATEST_SNAPSHOT UINT64_MAX
+
+/*
+ * An explicit transaction (BEGIN ... COMMIT/ROLLBACK).
+ *
+ * Undo works at page granularity: the first time a page is written inside a
+ * transaction we stash a copy of it (its "before-image"). ROLLBACK copies the
+ * before-images back and COMMIT just throws them away, so every statement in
+ * the transaction shares one commit instead of paying for its own.
+ */
+typedef struct {
+  bool is_open;
+  uint32_t num_rows_at_begin;
+  // copy of each page as it was at BEGIN; NULL if not written yet
+  void *undo_pages[TABLE_MAX_PAGES];
+  // pages that didn't exist at BEGIN, so rollback frees them instead
+  bool is_new_page[TABLE_MAX_PAGES];
+} Transaction;
+
+/*
+ * Primary key index: an in-memory B+ tree that maps a row's id to its
+ * row_num, so finding a row by id doesn't mean scanning the whole table.
+ *
+ * Internal nodes hold separator keys and child pointers, where keys[i] is the
+ * smallest id that lives under children[i + 1]. Leaves hold the ids
+ * themselves and the row_num of each one.
+ *
+ * Several appenders can be in the tree at once (see db_open_appender), so
+ * it uses optimistic lock coupling. Each node has a version that's odd
+ * while a writer has the node locked, like the page versions. Going down
+ * the tree takes no locks: a thread notes a node's version, reads what it
+ * needs from it, and only trusts that once the version turns out not to
+ * have moved, starting again from the root if it has. A writer locks just
+ * the nodes it changes, by bumping the version it read on the way down,
+ * so it knows nothing changed in between.
+ *
+ * Nodes are only ever freed with the whole tree (see rebuild_index), which
+ * nobody else is in then, so a pointer read from a node that's changed
+ * since still points at a node.
+ */
+#define INDEX_NODE_MAX_KEYS 31
+
+typedef struct IndexNode {
+  uint64_t version;
+  bool is_leaf;
+  uint32_t num_keys;
+  uint32_t keys[INDEX_NODE_MAX_KEYS];
+  union {
+    struct IndexNode *children[INDEX_NODE_MAX_KEYS + 1]; // internal nodes
+    uint32_t row_nums[INDEX_NODE_MAX_KEYS];               // leaves
+  };
+} IndexNode;
+
+IndexNode *new_index_node(bool is_leaf) {
+  IndexNode *node = malloc(sizeof(IndexNode));
+  node->version = 0;
+  node->is_leaf = is_leaf;
+  node->num_keys = 0;
+  return node;
+}
+
+void free_index(IndexNode *node) {
+  if (!node->is_leaf) {
+    for (uint32_t i = 0; i <= node->num_keys; i++) {
+      free_index(node->children[i]);
+    }
+  }
+  free(node);
+}
+
+// which child of an internal node the key lives under
+uint32_t index_child_for_key(IndexNode *node, uint32_t key) {
+  uint32_t i = 0;
+  while (i < node->num_keys && key >= node->keys[i]) {
+    i++;
+  }
+  return i;
+}
+
+// position of the first key >= key in a leaf
+uint32_t index_leaf_position(IndexNode *leaf, uint32_t key) {
+  uint32_t i = 0;
+  while (i < leaf->num_keys && leaf->keys[i] < key) {
+    i++;
+  }
+  return i;
+}
+
+// the node's version once no writer has it locked
+uint64_t index_read_version(IndexNode *node) {
+  while (true) {
+    uint64_t version = __atomic_load_n(&node->version, __ATOMIC_ACQUIRE);
+    if (version % 2 == 0) {
+      return version;
+    }
+    sched_yield();
+  }
+}
+
+// true if the node hasn't been locked since it was at `version`, so what
+// was read from it in between holds
+bool index_validate(IndexNode *node, uint64_t version) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&node->version, __ATOMIC_RELAXED) == version;
+}
+
+// locks the node if it's still at `version`. false if it's moved on
+bool index_lock(IndexNode *node, uint64_t version) {
+  if (!__atomic_compare_exchange_n(&node->version, &version, version + 1,
+                                   false, __ATOMIC_ACQUIRE,
+                                   __ATOMIC_RELAXED)) {
+    return false;
+  }
+  // the odd version is visible before anything written after it
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  return true;
+}
+
+void index_unlock(IndexNode *node) {
+  __atomic_store_n(&node->version, node->version + 1, __ATOMIC_RELEASE);
+}
+
+// the root, once it's a node that's still the root after its version was
+// read. A split can put a new root on top at any time
+IndexNode *index_read_root(IndexNode **root, uint64_t *version) {
+  while (true) {
+    IndexNode *node = __atomic_load_n(root, __ATOMIC_ACQUIRE);
+    *version = index_read_version(node);
+    if (__atomic_load_n(root, __ATOMIC_ACQUIRE) == node) {
+      return node;
+    }
+  }
+}
+
+// walks down to the leaf the key belongs in without locking anything, and
+// returns it along with the version it had when we got there
+IndexNode *index_find_leaf(IndexNode **root, uint32_t key,
+                           uint64_t *version) {
+  while (true) {
+    IndexNode *node = index_read_root(root, version);
+    while (!node->is_leaf) {
+      // the child's version is read before the parent's is checked, so a
+      // split of the child in between shows up in one or the other
+      IndexNode *child = node->children[index_child_for_key(node, key)];
+      uint64_t child_version = index_read_version(child);
+      if (!index_validate(node, *version)) {
+        break;
+      }
+      node = child;
+      *version = child_version;
+    }
+    if (node->is_leaf) {
+      return node;
+    }
+  }
+}
+
+bool index_find(IndexNode **root, uint32_t key, uint32_t *row_num) {
+  while (true) {
+    uint64_t version;
+    IndexNode *leaf = index_find_leaf(root, key, &version);
+    uint32_t i = index_leaf_position(leaf, key);
+    bool is_found = i < leaf->num_keys && leaf->keys[i] == key;
+    uint32_t found_row_num = is_found ? leaf->row_nums[i] : 0;
+    if (index_validate(leaf, version)) {
+      if (is_found) {
+        *row_num = found_row_num;
+      }
+      return is_found;
+    }
+  }
+}
+
+/*
+ * Splits parent->children[child_index], which must be full, in two and adds
+ * the new right half to the parent.
+ *
+ * A leaf copies its middle key up (the key still has to be in a leaf), an
+ * internal node moves it up.
+ */
+void index_split_child(IndexNode *parent, uint32_t child_index) {
+  IndexNode *left = parent->children[child_index];
+  IndexNode *right = new_index_node(left->is_leaf);
+  uint32_t mid = INDEX_NODE_MAX_KEYS / 2;
+  uint32_t separator = left->keys[mid];
+
+  if (left->is_leaf) {
+    right->num_keys = left->num_keys - mid;
+    memcpy(right->keys, left->keys + mid, right->num_keys * sizeof(uint32_t));
+    memcpy(right->row_nums, left->row_nums + mid,
+           right->num_keys * sizeof(uint32_t));
+  } else {
+    right->num_keys = left->num_keys - mid - 1;
+    memcpy(right->keys, left->keys + mid + 1,
+           right->num_keys * sizeof(uint32_t));
+    memcpy(right->children, left->children + mid + 1,
+           (right->num_keys + 1) * sizeof(IndexNode *));
+  }
+  left->num_keys = mid;
+
+  for (uint32_t i = parent->num_keys; i > child_index; i--) {
+    parent->keys[i] = parent->keys[i - 1];
+    parent->children[i + 1] = parent->children[i];
+  }
+  parent->keys[child_index] = separator;
+  parent->children[child_index + 1] = right;
+  parent->num_keys += 1;
+}
+
+/*
+ * Adds key -> row_num, unless the key is already there, in which case it
+ * hands back the existing row_num and returns false. That way a caller can
+ * find out "does this id exist" and "insert it" in one trip down the tree.
+ *
+ * Full nodes are split on the way down, so there's always room in the
+ * parent for a split and nothing has to walk back up. A split locks the
+ * full node and its parent and then starts again from the root; otherwise
+ * only the leaf the key goes in is locked.
+ */
+bool index_insert(IndexNode **root, uint32_t key, uint32_t row_num,
+                  uint32_t *existing_row_num) {
+restart:;
+  uint64_t version;
+  IndexNode *node = index_read_root(root, &version);
+  IndexNode *parent = NULL;
+  uint64_t parent_version = 0;
+  uint32_t child_index = 0;
+
+  while (true) {
+    if (node->num_keys == INDEX_NODE_MAX_KEYS) {
+      if (parent != NULL && !index_lock(parent, parent_version)) {
+        goto restart;
+      }
+      if (!index_lock(node, version)) {
+        if (parent != NULL) {
+          index_unlock(parent);
+        }
+        goto restart;
+      }
+      if (parent == NULL) {
+        if (__atomic_load_n(root, __ATOMIC_ACQUIRE) != node) {
+          // somebody else split the root first
+          index_unlock(node);
+          goto restart;
+        }
+        IndexNode *new_root = new_index_node(false);
+        new_root->children[0] = node;
+        index_split_child(new_root, 0);
+        __atomic_store_n(root, new_root, __ATOMIC_RELEASE);
+      } else {
+        index_split_child(parent, child_index);
+        index_unlock(parent);
+      }
+      index_unlock(node);
+      goto restart;
+    }
+    if (node->is_leaf) {
+      break;
+    }
+
+    uint32_t i = index_child_for_key(node, key);
+    IndexNode *child = node->children[i];
+    uint64_t child_version = index_read_version(child);
+    if (!index_validate(node, version)) {
+      goto restart;
+    }
+    parent = node;
+    parent_version = version;
+    child_index = i;
+    node = child;
+    version = child_version;
+  }
+
+  if (!index_lock(node, version)) {
+    goto restart;
+  }
+  uint32_t position = index_leaf_position(node, key);
+  if (position < node->num_keys && node->keys[position] == key) {
+    *existing_row_num = node->row_nums[position];
+    index_unlock(node);
+    return false;
+  }
+  for (uint32_t i = node->num_keys; i > position; i--) {
+    node->keys[i] = node->keys[i - 1];
+    node->row_nums[i] = node->row_nums[i - 1];
+  }
+  node->keys[position] = key;
+  node->row_nums[position] = row_num;
+  node->num_keys += 1;
+  index_unlock(node);
+  return true;
+}
+
+// the leaf the key belongs in, locked
+IndexNode *index_lock_leaf(IndexNode **root, uint32_t key) {
+  while (true) {
+    uint64_t version;
+    IndexNode *leaf = index_find_leaf(root, key, &version);
+    if (index_lock(leaf, version)) {
+      return leaf;
+    }
+  }
+}
+
+// points an existing key at a new row_num (vacuum moved the row)
+void index_set(IndexNode **root, uint32_t key, uint32_t row_num) {
+  IndexNode *leaf = index_lock_leaf(root, key);
+  uint32_t i = index_leaf_position(leaf, key);
+  if (i < leaf->num_keys && leaf->keys[i] == key) {
+    leaf->row_nums[i] = row_num;
+  }
+  index_unlock(leaf);
+}
+
+/*
+ * Removes a key from its leaf. Nodes aren't merged when they get emptier;
+ * the separators above stay valid, so lookups still work, and a rebuild
+ * after rollback tightens the tree back up.
+ */
+void index_remove(IndexNode **root, uint32_t key) {
+  IndexNode *leaf = index_lock_leaf(root, key);
+  uint32_t position = index_leaf_position(leaf, key);
+  if (position < leaf->num_keys && leaf->keys[position] == key) {
+    for (uint32_t i = position; i + 1 < leaf->num_keys; i++) {
+      leaf->keys[i] = leaf->keys[i + 1];
+      leaf->row_nums[i] = leaf->row_nums[i + 1];
+    }
+    leaf->num_keys -= 1;
+  }
+  index_unlock(leaf);
+}
+
+/*
+ * Free-space map: one bit per page, set when the page has at least one
+ * tombstoned slot that an insert can reuse.
+ *
+ * Together with the tombstone bitmap inside each page this is a two-level
+ * summary: this map says *which page* has room, the page's own bitmap says
+ * *which slot*. Finding a hole is then a couple of word scans instead of
+ * walking every row.
+ */
+#define FREE_SPACE_MAP_WORDS ((TABLE_MAX_PAGES + 63) / 64)
+
+/*
+ * Readers on other threads (see db_open_reader): one thread writes the
+ * table, any number of others read it at the same time, and neither side
+ * ever takes a lock.
+ *
+ * - num_rows and the page pointers are published with release stores, so
+ *   a reader that sees a row count also sees every row and page behind it.
+ *   Appending a row doesn't touch anything a reader can already see.
+ * - Everything that changes a row a reader may already be looking at
+ *   (update, delete, vacuum, rollback) happens inside a write section on
+ *   its page: the page's version is odd while it's being written. Readers
+ *   copy the row out and keep the copy only if the version was even and
+ *   hadn't moved by the end. That's a seqlock, one per page.
+ * - A page that goes away (truncated by vacuum, or thrown out by rollback)
+ *   isn't freed while a reader might still be copying from it. It's retired
+ *   with the current epoch, and freed once every reader that was reading
+ *   back then has finished its step (epoch-based reclamation).
+ *
+ * Appenders (see db_open_appender) are readers that can also insert, on
+ * any number of threads at once, still without a lock on the way:
+ *
+ * - An append doesn't go in the table straight away. It claims its id in
+ *   the index (so a duplicate is still caught right then) and goes in the
+ *   appender's own buffer (see AppendBuffer), and the whole buffer goes in
+ *   at once when it's flushed.
+ * - A flush reserves its slots by bumping num_reserved_rows, and adds the
+ *   pages with a compare-and-swap if nobody has yet. Appended rows only
+ *   ever go at the end, never in a hole.
+ * - Once its rows are written it sets their bits in written_slots, and
+ *   moves num_rows past every slot from there on that's written too. So
+ *   num_rows is a watermark: every row below it is all there, whichever
+ *   thread wrote it and in whatever order they finished.
+ * - The writer's thread closes the appends gate around everything it
+ *   writes (and from BEGIN to COMMIT, since a rollback puts whole pages
+ *   back), and around vacuum, import and export. It waits for the appends
+ *   already going, and flushes every buffer before it gets on with it (so
+ *   it never finds a pending id in the index), and new appends wait for it
+ *   to open again. So the writer
+ *   never shares the end of the table, the free-space map or the index
+ *   with an append, only readers do.
+ * - An appended row is stamped with the last commit, so a scan's snapshot
+ *   alone doesn't keep it out. A scan also stops at num_rows as it was
+ *   when it started (see take_snapshot).
+ * - Appenders share the index with each other through optimistic lock
+ *   coupling (see IndexNode).
+ */
+#define MAX_READERS 64
+
+/*
+ * Rows an appender has inserted but not yet put in the table. Filling the
+ * buffer touches nothing shared but the index; it's flushed a whole buffer
+ * at a time, with one bump of num_reserved_rows and one of num_rows, rather
+ * than once a row.
+ *
+ * Each row's slot is promised as it goes in the buffer (see promise_row),
+ * so a flush can't find the table full: an insert that doesn't fit fails
+ * there and then, like it would unbuffered. Only the rows actually
+ * buffered are promised, so a nearly full table's last slots go to
+ * whichever appenders insert first.
+ */
+#define APPEND_BUFFER_ROWS 64
+
+typedef struct AppendBuffer {
+  Row rows[APPEND_BUFFER_ROWS];
+  uint32_t num_rows;
+} AppendBuffer;
+
+// stands in for the row number of an id that's in an append buffer
+#define PENDING_ROW_NUM UINT32_MAX
+
+typedef struct {
+  // the epoch the reader entered its current step in; 0 between steps
+  uint64_t epoch;
+  // an appender's buffer, so the writer can flush it (see block_appends)
+  AppendBuffer *append_buffer;
+  uint32_t is_taken;
+  // each slot on its own cache line, since each is written by a different
+  // thread
+  char padding[44];
+} ReaderSlot;
+
+typedef struct {
+  void *page;
+  uint64_t epoch;
+} RetiredPage;
+
+/*
+ * Open scans register their snapshot in a slot of their own, so the writer
+ * knows which ended versions somebody may still need, and how far into
+ * the table it goes. If every slot is taken a scan just counts itself as
+ * unslotted, and while any are, nothing gets collected or truncated.
+ */
+#define MAX_SNAPSHOT_SLOTS 128
+#define NO_SNAPSHOT_SLOT MAX_SNAPSHOT_SLOTS
+
+struct Table {
+  // rows below this are all written (see publish_rows)
+  uint32_t num_rows;
+  // rows handed out to be written, num_rows or more
+  uint32_t num_reserved_rows;
+  // slots promised to append buffers, num_reserved_rows or more
+  uint32_t num_promised_rows;
+  void *pages[TABLE_MAX_PAGES]; // array of pointers
+  uint64_t free_space_map[FREE_SPACE_MAP_WORDS];
+  IndexNode *index;
+  Transaction transaction;
+  // selects that have started handing out rows and haven't finished
+  uint32_t num_open_scans;
+  // set while the writer's statement may be changing versions in place
+  // (see can_overwrite_versions)
+  uint32_t is_overwriting;
+
+  // odd while the page is being written
+  uint32_t page_versions[TABLE_MAX_PAGES];
+  uint64_t epoch;
+  ReaderSlot reader_slots[MAX_READERS];
+  // pages waiting for the readers that could see them to move on
+  RetiredPage *retired_pages;
+  uint32_t num_retired_pages;
+  uint32_t retired_pages_capacity;
+
+  // the stamp of the last commit; the next one writes with this + 1
+  uint64_t commit_stamp;
+  // set once something's been written with that stamp, so a statement
+  // that fails without writing anything doesn't commit
+  bool has_uncommitted_writes;
+  // snapshots of open scans, 0 in a free slot, and where each scan stops
+  uint64_t snapshots[MAX_SNAPSHOT_SLOTS];
+  uint32_t snapshot_end_rows[MAX_SNAPSHOT_SLOTS];
+  uint32_t num_unslotted_scans;
+  uint32_t num_reader_handles;
+  // ended versions whose slots aren't free yet, by row_num
+  uint32_t *dead_versions;
+  uint32_t num_dead_versions;
+  uint32_t dead_versions_capacity;
+
+  // per page, the slots that are written but that num_rows hasn't got to
+  // yet
+  uint32_t written_slots[TABLE_MAX_PAGES];
+  uint32_t num_active_appends;
+  uint32_t are_appends_blocked;
+};
+
+/*
+ * Partitioned tables (see db_open_partitioned). Each partition is a whole
+ * table of its own, with its own pages, index and free-space map, behind
+ * a plain handle of its own, and a row goes in the one its id hashes to. A
+ * table has always had one writer at a time, so each partition gets a lock
+ * that makes whichever thread holds it that writer:
+ *
+ * - An insert, update or delete touches one id, so it only takes that
+ *   id's partition's lock. Writes to different partitions run in parallel.
+ * - A select takes every lock just long enough to open a scan on each
+ *   partition, so it sees them all as of one moment. Then it reads them
+ *   in batches on worker threads, taking each partition's lock once per
+ *   batch.
+ * - BEGIN takes every lock and holds on to them until COMMIT or ROLLBACK.
+ *   Statements on the transaction's own thread don't take them again, and
+ *   neither do worker threads running its statements.
+ * - Vacuum and export fan out over the partitions on worker threads,
+ *   each holding one partition's lock at a time. Import does too, but
+ *   under every lock, as it's all or nothing.
+ *
+ * Locks are always taken in partition order, so they can't deadlock.
+ */
+#define MAX_PARTITIONS 64
+
+typedef struct {
+  DB *db;
+  pthread_mutex_t lock;
+} Partition;
+
+struct DB {
+  Table *table;
+  // bumped by db_interrupt; a statement prepared before the bump stops
+  uint32_t num_interrupts;
+  uint32_t timeout_ms;
+  // a handle from db_open_reader, and its slot in the table
+  bool is_reader;
+  uint32_t reader_slot;
+  // a reader handle from db_open_appender, which can insert too, has the
+  // buffer its inserts go in. NULL on any other handle
+  AppendBuffer *append_buffer;
+  // a handle from db_open_partitioned has no table of its own, just its
+  // partitions. NULL on any other handle
+  Partition *partitions;
+  uint32_t num_partitions;
+  // set while a transaction holds every partition's lock, and whose
+  uint32_t is_transaction_open;
+  pthread_t transaction_thread;
+};
+
+Table *new_table() {
+  // allocate memory and cast Table pointer
+  //
+  // Explanation:
+  // malloc returns a generic pointer void*
+  // so `(Table*)malloc(sizeof(Table))` is saying,
+  // "the pointer of that address that we just allocated is of type Table"
+  Table *table = (Table *)malloc(sizeof(Table));
+
+  table->num_rows = 0;
+  table->num_reserved_rows = 0;
+  table->num_promised_rows = 0;
+
+  // defensive programming:
+  // apparently good practice in C to instantiate null pointers
+  // bc it can end up being filled with whatever random memory values present in
+  // that memory location
+  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+    table->pages[i] = NULL;
+  }
+  for (uint32_t i = 0; i < FREE_SPACE_MAP_WORDS; i++) {
+    table->free_space_map[i] = 0;
+  }
+  table->index = new_index_node(true);
+  table->num_open_scans = 0;
+  table->is_overwriting = false;
+
+  memset(table->page_versions, 0, sizeof(table->page_versions));
+  // 0 means "not reading" in a reader slot, so epochs start at 1
+  table->epoch = 1;
+  memset(table->reader_slots, 0, sizeof(table->reader_slots));
+  table->retired_pages = NULL;
+  table->num_retired_pages = 0;
+  table->retired_pages_capacity = 0;
+
+  // 0 means "free" in a snapshot slot, so stamps start at 1
+  table->commit_stamp = 1;
+  table->has_uncommitted_writes = false;
+  memset(table->snapshots, 0, sizeof(table->snapshots));
+  memset(table->snapshot_end_rows, 0, sizeof(table->snapshot_end_rows));
+  table->num_unslotted_scans = 0;
+  table->num_reader_handles = 0;
+  table->dead_versions = NULL;
+  table->num_dead_versions = 0;
+  table->dead_versions_capacity = 0;
+
+  memset(table->written_slots, 0, sizeof(table->written_slots));
+  table->num_active_appends = 0;
+  table->are_appends_blocked = 0;
+
+  table->transaction.is_open = false;
+  table->transaction.num_rows_at_begin = 0;
+  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+    table->transaction.undo_pages[i] = NULL;
+    table->transaction.is_new_page[i] = false;
+  }
+  return table;
+}
+
+// drops every before-image the open transaction was holding on to
+void discard_undo_pages(Transaction *transaction) {
+  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+    free(transaction->undo_pages[i]);
+    transaction->undo_pages[i] = NULL;
+    transaction->is_new_page[i] = false;
+  }
+}
+
+// cleanup table
+void free_table(Table *table) {
+  // an uncommitted transaction at exit is simply thrown away
+  discard_undo_pages(&table->transaction);
+  for (int i = 0; i < TABLE_MAX_PAGES && table->pages[i]; i++) {
+    free(table->pages[i]);
+  }
+  // every reader has been closed by now
+  for (uint32_t i = 0; i < table->num_retired_pages; i++) {
+    free(table->retired_pages[i].page);
+  }
+  free(table->retired_pages);
+  free(table->dead_versions);
+  free_index(table->index);
+  free(table);
+}
+
+// bracket every change to a page a reader may be copying from
+void begin_page_write(Table *table, uint32_t page_num) {
+  uint32_t *version = &table->page_versions[page_num];
+  __atomic_store_n(version, *version + 1, __ATOMIC_RELAXED);
+  // the odd version is visible before anything written after it
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void end_page_write(Table *table, uint32_t page_num) {
+  uint32_t *version = &table->page_versions[page_num];
+  __atomic_store_n(version, *version + 1, __ATOMIC_RELEASE);
+}
+
+uint32_t get_num_rows(Table *table) {
+  return __atomic_load_n(&table->num_rows, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Moves the end of the table, with the appends gate closed (see
+ * block_appends) so there's nothing reserved or promised past it.
+ *
+ * When it moves back, the slots past it may be appended to again, and a
+ * scan that started before still goes up to the old end. Bumping the
+ * commit stamp after the move stamps those appends too new for it to see,
+ * and a scan whose snapshot takes in the bump reads the new end (see
+ * take_snapshot).
+ */
+void set_num_rows(Table *table, uint32_t num_rows) {
+  bool is_moving_back = num_rows < table->num_rows;
+  table->num_reserved_rows = num_rows;
+  table->num_promised_rows = num_rows;
+  __atomic_store_n(&table->num_rows, num_rows, __ATOMIC_SEQ_CST);
+  if (is_moving_back) {
+    __atomic_store_n(&table->commit_stamp, table->commit_stamp + 1,
+                     __ATOMIC_SEQ_CST);
+  }
+}
+
+// the page, added first if it isn't there yet. When two threads add the
+// same page at once, the one that loses frees its copy and uses the other
+void *get_page(Table *table, uint32_t page_num) {
+  void *page = __atomic_load_n(&table->pages[page_num], __ATOMIC_ACQUIRE);
+  if (page == NULL) {
+    // calloc so the tombstone bitmap at the end of the page starts out
+    // empty
+    void *new_page = calloc(1, PAGE_SIZE);
+    if (__atomic_compare_exchange_n(&table->pages[page_num], &page, new_page,
+                                    false, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE)) {
+      page = new_page;
+    } else {
+      free(new_page);
+    }
+  }
+  return page;
+}
+
+/*
+ * Promises a slot at the end of the table to an append buffer, for the row
+ * it's being handed. A compare-and-swap rather than a plain fetch-add, so
+ * a full table never promises slots past its end. false when it's full.
+ */
+bool promise_row(Table *table) {
+  uint32_t promised =
+      __atomic_load_n(&table->num_promised_rows, __ATOMIC_RELAXED);
+  do {
+    if (promised == TABLE_MAX_ROWS) {
+      return false;
+    }
+  } while (!__atomic_compare_exchange_n(&table->num_promised_rows, &promised,
+                                        promised + 1, false, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED));
+  return true;
+}
+
+/*
+ * Marks reserved rows as written, then moves num_rows past every written
+ * slot it can. Whoever writes the slot num_rows is stuck on moves it past
+ * the ones that finished before it too: they set their bits before
+ * looking at num_rows, so either they see it move or it sees their bits.
+ */
+void publish_rows(Table *table, uint32_t first_row_num, uint32_t count) {
+  for (uint32_t row_num = first_row_num; row_num < first_row_num + count;
+       row_num++) {
+    __atomic_fetch_or(&table->written_slots[row_num / ROWS_PER_PAGE],
+                      1u << (row_num % ROWS_PER_PAGE), __ATOMIC_SEQ_CST);
+  }
+
+  uint32_t watermark = __atomic_load_n(&table->num_rows, __ATOMIC_SEQ_CST);
+  while (watermark < TABLE_MAX_ROWS) {
+    uint32_t *written = &table->written_slots[watermark / ROWS_PER_PAGE];
+    uint32_t bit = 1u << (watermark % ROWS_PER_PAGE);
+    if (!(__atomic_load_n(written, __ATOMIC_SEQ_CST) & bit)) {
+      return;
+    }
+    if (__atomic_compare_exchange_n(&table->num_rows, &watermark,
+                                    watermark + 1, false, __ATOMIC_SEQ_CST,
+                                    __ATOMIC_SEQ_CST)) {
+      // num_rows can't come back down past it while an append is going
+      __atomic_fetch_and(written, ~bit, __ATOMIC_SEQ_CST);
+      watermark += 1;
+    }
+  }
+}
+
+// an append is in flight from here to exit_append, unless the gate's
+// closed, in which case it waits for it to open
+void enter_append(Table *table) {
+  while (true) {
+    __atomic_add_fetch(&table->num_active_appends, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&table->are_appends_blocked, __ATOMIC_SEQ_CST) == 0) {
+      return;
+    }
+    __atomic_sub_fetch(&table->num_active_appends, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&table->are_appends_blocked, __ATOMIC_ACQUIRE) >
+           0) {
+      sched_yield();
+    }
+  }
+}
+
+void exit_append(Table *table) {
+  __atomic_sub_fetch(&table->num_active_appends, 1, __ATOMIC_RELEASE);
+}
+
+// frees the retired pages no reader can still be copying from
+void reclaim_pages(Table *table) {
+  uint64_t oldest_epoch = __atomic_load_n(&table->epoch, __ATOMIC_SEQ_CST);
+  for (uint32_t i = 0; i < MAX_READERS; i++) {
+    uint64_t epoch =
+        __atomic_load_n(&table->reader_slots[i].epoch, __ATOMIC_SEQ_CST);
+    if (epoch != 0 && epoch < oldest_epoch) {
+      oldest_epoch = epoch;
+    }
+  }
+
+  uint32_t num_kept = 0;
+  for (uint32_t i = 0; i < table->num_retired_pages; i++) {
+    RetiredPage retired = table->retired_pages[i];
+    if (retired.epoch < oldest_epoch) {
+      free(retired.page);
+    } else {
+      table->retired_pages[num_kept++] = retired;
+    }
+  }
+  table->num_retired_pages = num_kept;
+}
+
+/*
+ * Takes a page out of the table. A reader that entered its step before
+ * this (in an epoch <= the page's) may still hold on to it, but one that
+ * enters after can't find it any more.
+ */
+void retire_page(Table *table, uint32_t page_num) {
+  begin_page_write(table, page_num);
+  void *page = table->pages[page_num];
+  __atomic_store_n(&table->pages[page_num], NULL, __ATOMIC_SEQ_CST);
+  end_page_write(table, page_num);
+
+  if (table->num_retired_pages == table->retired_pages_capacity) {
+    table->retired_pages_capacity =
+        table->retired_pages_capacity > 0 ? table->retired_pages_capacity * 2
+                                          : 8;
+    table->retired_pages =
+        realloc(table->retired_pages,
+                table->retired_pages_capacity * sizeof(RetiredPage));
+  }
+  RetiredPage *retired = &table->retired_pages[table->num_retired_pages++];
+  retired->page = page;
+  retired->epoch = table->epoch;
+  __atomic_add_fetch(&table->epoch, 1, __ATOMIC_SEQ_CST);
+  reclaim_pages(table);
+}
+
+// a reader's step is in its epoch from start to finish
+void enter_epoch(DB *reader) {
+  Table *table = reader->table;
+  __atomic_store_n(&table->reader_slots[reader->reader_slot].epoch,
+                   __atomic_load_n(&table->epoch, __ATOMIC_SEQ_CST),
+                   __ATOMIC_SEQ_CST);
+}
+
+void exit_epoch(DB *reader) {
+  __atomic_store_n(&reader->table->reader_slots[reader->reader_slot].epoch, 0,
+                   __ATOMIC_RELEASE);
+}
+
+/*
+ * SQL parsing: a lexer that cuts one token at a time straight out of the
+ * input, and a recursive-descent parser on top of it, one function per
+ * grammar rule:
+ *
+ *   statement   := insert | select | update | delete
+ *                | "begin" | "commit" | "rollback"
+ *   insert      := "insert" ["or" "replace"] id value value [on_conflict]
+ *   on_conflict := "on" "conflict" "(" "id" ")" "do" "update"
+ *   select      := "select"
+ *   update      := "update" "set" assignment {[","] assignment} where
+ *   assignment  := ("username" | "email") "=" value
+ *   delete      := "delete" where
+ *   where       := "where" "id" "=" id
+ *
+ * Tokens are just (pointer, length) slices of the input, which is never
+ * written to, and the only place parsed values get copied to is the
+ * Statement itself: its fixed-size fields are the statement's arena, so
+ * parsing never touches the heap. All the state lives in a Parser on the
+ * caller's stack, which makes it safe to parse on many threads at once.
+ */
+typedef enum {
+  TOKEN_WORD,
+  TOKEN_EQUALS,
+  TOKEN_COMMA,
+  TOKEN_LEFT_PAREN,
+  TOKEN_RIGHT_PAREN,
+  TOKEN_END
+} TokenType;
+
+typedef struct {
+  TokenType type;
+  const char *start;
+  size_t length;
+} Token;
+
+/*
+ * The lexer doesn't look at the input a byte at a time. It classifies a
+ * whole 64-byte block at once into bitmasks, one bit per byte, saying which
+ * bytes are spaces and which are punctuation (simdjson calls this the
+ * "structural index"). Finding where a word ends is then a shift and a
+ * count-trailing-zeros on the mask instead of a loop.
+ */
+#define LEXER_BLOCK_SIZE 64
+
+typedef struct {
+  const char *next; // where lexing picks up
+  const char *end;
+  Token token; // the token that was just lexed
+
+  // structural index of the block starting at block_start: bit i is set
+  // if block_start[i] is a space / punctuation character
+  const char *block_start;
+  uint64_t space_mask;
+  uint64_t punctuation_mask;
+} Parser;
+
+bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+bool is_punctuation(char c) {
+  return c == '=' || c == ',' || c == '(' || c == ')';
+}
+
+/*
+ * Classifies 64 bytes into the two masks, 32 (AVX2) or 16 (SSE2, NEON)
+ * bytes per instruction: compare the chunk against each delimiter, OR the
+ * results together, then movemask squashes the per-byte 0x00/0xFF answers
+ * into one bit per byte. Without SIMD it falls back to a plain loop.
+ */
+void classify_block(const char *bytes, uint64_t *space_mask,
+                    uint64_t *punctuation_mask) {
+  uint64_t spaces = 0;
+  uint64_t punctuation = 0;
+
+#if defined(__AVX2__)
+  for (uint32_t i = 0; i < LEXER_BLOCK_SIZE; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)(bytes + i));
+    __m256i is_space_byte = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(' ')),
+                        _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\t'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\r')),
+                        _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\n'))));
+    __m256i is_punctuation_byte = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('=')),
+                        _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(','))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('(')),
+                        _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(')'))));
+    spaces |= (uint64_t)(uint32_t)_mm256_movemask_epi8(is_space_byte) << i;
+    punctuation |= (uint64_t)(uint32_t)_mm256_movemask_epi8(is_punctuation_byte)
+                   << i;
+  }
+#elif defined(__SSE2__)
+  for (uint32_t i = 0; i < LEXER_BLOCK_SIZE; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(bytes + i));
+    __m128i is_space_byte =
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')),
+                                  _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\t'))),
+                     _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\r')),
+                                  _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n'))));
+    __m128i is_punctuation_byte =
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('=')),
+                                  _mm_cmpeq_epi8(chunk, _mm_set1_epi8(','))),
+                     _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('(')),
+                                  _mm_cmpeq_epi8(chunk, _mm_set1_epi8(')'))));
+    spaces |= (uint64_t)_mm_movemask_epi8(is_space_byte) << i;
+    punctuation |= (uint64_t)_mm_movemask_epi8(is_punctuation_byte) << i;
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  // NEON has no movemask: keep one distinct bit per byte and add the bytes
+  // of each half up instead
+  static const uint8_t bit_of_byte[16] = {1, 2, 4, 8, 16, 32, 64, 128,
+                                          1, 2, 4, 8, 16, 32, 64, 128};
+  uint8x16_t bits = vld1q_u8(bit_of_byte);
+  for (uint32_t i = 0; i < LEXER_BLOCK_SIZE; i += 16) {
+    uint8x16_t chunk = vld1q_u8((const uint8_t *)(bytes + i));
+    uint8x16_t is_space_byte =
+        vorrq_u8(vorrq_u8(vceqq_u8(chunk, vdupq_n_u8(' ')),
+                          vceqq_u8(chunk, vdupq_n_u8('\t'))),
+                 vorrq_u8(vceqq_u8(chunk, vdupq_n_u8('\r')),
+                          vceqq_u8(chunk, vdupq_n_u8('\n'))));
+    uint8x16_t is_punctuation_byte =
+        vorrq_u8(vorrq_u8(vceqq_u8(chunk, vdupq_n_u8('=')),
+                          vceqq_u8(chunk, vdupq_n_u8(','))),
+                 vorrq_u8(vceqq_u8(chunk, vdupq_n_u8('(')),
+                          vceqq_u8(chunk, vdupq_n_u8(')'))));
+    uint8x16_t space_bits = vandq_u8(is_space_byte, bits);
+    uint8x16_t punctuation_bits = vandq_u8(is_punctuation_byte, bits);
+    spaces |= (uint64_t)(vaddv_u8(vget_low_u8(space_bits)) |
+                         vaddv_u8(vget_high_u8(space_bits)) << 8)
+              << i;
+    punctuation |= (uint64_t)(vaddv_u8(vget_low_u8(punctuation_bits)) |
+                              vaddv_u8(vget_high_u8(punctuation_bits)) << 8)
+                   << i;
+  }
+#else
+  for (uint32_t i = 0; i < LEXER_BLOCK_SIZE; i++) {
+    spaces |= (uint64_t)is_space(bytes[i]) << i;
+    punctuation |= (uint64_t)is_punctuation(bytes[i]) << i;
+  }
+#endif
+
+  *space_mask = spaces;
+  *punctuation_mask = punctuation;
+}
+
+// builds the structural index for the 64 bytes starting at block_start
+void index_block(Parser *parser, const char *block_start) {
+  const char *bytes = block_start;
+
+  // near the end of the input there's less than a block left. Copy it out
+  // and pad with spaces rather than read past the end (which could be the
+  // end of an mmap)
+  char padded[LEXER_BLOCK_SIZE];
+  size_t remaining = parser->end - block_start;
+  if (remaining < LEXER_BLOCK_SIZE) {
+    memset(padded, ' ', LEXER_BLOCK_SIZE);
+    memcpy(padded, block_start, remaining);
+    bytes = padded;
+  }
+
+  parser->block_start = block_start;
+  classify_block(bytes, &(parser->space_mask), &(parser->punctuation_mask));
+}
+
+typedef enum {
+  FIND_NON_SPACE,
+  FIND_SPACE,
+  FIND_SPACE_OR_PUNCTUATION
+} LexerSearch;
+
+// first byte at or after `from` matching `search`, or the end of the input
+const char *lexer_find(Parser *parser, const char *from, LexerSearch search) {
+  while (from < parser->end) {
+    if (parser->block_start == NULL || from < parser->block_start ||
+        from >= parser->block_start + LEXER_BLOCK_SIZE) {
+      index_block(parser, from);
+    }
+
+    uint64_t mask;
+    switch (search) {
+    case (FIND_NON_SPACE):
+      mask = ~parser->space_mask;
+      break;
+    case (FIND_SPACE):
+      mask = parser->space_mask;
+      break;
+    default:
+      mask = parser->space_mask | parser->punctuation_mask;
+      break;
+    }
+    mask >>= from - parser->block_start;
+
+    if (mask != 0) {
+      const char *found = from + __builtin_ctzll(mask);
+      // the padding after the end of the input counts as spaces
+      return found < parser->end ? found : parser->end;
+    }
+    from = parser->block_start + LEXER_BLOCK_SIZE;
+  }
+  return parser->end;
+}
+
+void skip_spaces(Parser *parser) {
+  parser->next = lexer_find(parser, parser->next, FIND_NON_SPACE);
+}
+
+// lexes the next token: a punctuation character or a word
+void next_token(Parser *parser) {
+  skip_spaces(parser);
+  Token *token = &(parser->token);
+  token->start = parser->next;
+  token->length = 0;
+
+  if (parser->next == parser->end) {
+    token->type = TOKEN_END;
+    return;
+  }
+
+  switch (*parser->next) {
+  case ('='):
+    token->type = TOKEN_EQUALS;
+    break;
+  case (','):
+    token->type = TOKEN_COMMA;
+    break;
+  case ('('):
+    token->type = TOKEN_LEFT_PAREN;
+    break;
+  case (')'):
+    token->type = TOKEN_RIGHT_PAREN;
+    break;
+  default:
+    token->type = TOKEN_WORD;
+    parser->next =
+        lexer_find(parser, parser->next, FIND_SPACE_OR_PUNCTUATION);
+    token->length = parser->next - token->start;
+    return;
+  }
+
+  parser->next++;
+  token->length = 1;
+}
+
+// lexes everything up to the next space as one word. insert values can
+// contain any character, punctuation included
+void next_value(Parser *parser) {
+  skip_spaces(parser);
+  Token *token = &(parser->token);
+  token->start = parser->next;
+  parser->next = lexer_find(parser, parser->next, FIND_SPACE);
+  token->length = parser->next - token->start;
+  token->type = token->length > 0 ? TOKEN_WORD : TOKEN_END;
+}
+
+bool token_is_keyword(Token *token, const char *keyword) {
+  return token->type == TOKEN_WORD && token->length == strlen(keyword) &&
+         memcmp(token->start, keyword, token->length) == 0;
+}
+
+bool expect_keyword(Parser *parser, const char *keyword) {
+  next_token(parser);
+  return token_is_keyword(&(parser->token), keyword);
+}
+
+bool expect_token(Parser *parser, TokenType type) {
+  next_token(parser);
+  return parser->token.type == type;
+}
+
+// the statement has to end here, nothing may follow
+PrepareResult expect_end(Parser *parser) {
+  next_token(parser);
+  return parser->token.type == TOKEN_END ? PREPARE_SUCCESS
+                                         : PREPARE_SYNTAX_ERROR;
+}
+
+/*
+ * Turns a token into an id. Unlike atoi this rejects anything that isn't
+ * all digits and notices when the number doesn't fit, instead of quietly
+ * wrapping around.
+ */
+PrepareResult parse_id(Token *token, uint32_t *id) {
+  if (token->type != TOKEN_WORD) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  const char *digits = token->start;
+  size_t num_digits = token->length;
+  // any sign at all, even on -0
+  if (digits[0] == '-') {
+    return PREPARE_NEGATIVE_ID;
+  }
+
+  uint64_t value = 0;
+  for (size_t i = 0; i < num_digits; i++) {
+    if (digits[i] < '0' || digits[i] > '9') {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    value = value * 10 + (digits[i] - '0');
+    // ids are printed as signed ints, so that's the limit
+    if (value > INT32_MAX) {
+      return PREPARE_ID_OUT_OF_RANGE;
+    }
+  }
+
+  *id = value;
+  return PREPARE_SUCCESS;
+}
+
+// copies a token into a fixed-size column, null-terminating it
+PrepareResult parse_string(Token *token, char *column, size_t max_length) {
+  if (token->type != TOKEN_WORD) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (token->length > max_length) {
+    return PREPARE_STRING_TOO_LONG;
+  }
+  memcpy(column, token->start, token->length);
+  column[token->length] = '\0';
+  return PREPARE_SUCCESS;
+}
+
+// where id = <n>
+PrepareResult parse_where(Parser *parser, Statement *statement) {
+  if (!token_is_keyword(&(parser->token), "where") ||
+      !expect_keyword(parser, "id") || !expect_token(parser, TOKEN_EQUALS)) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  next_token(parser);
+  PrepareResult result = parse_id(&(parser->token), &(statement->where_id));
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
+  return expect_end(parser);
+}
+
+// on conflict(id) do update
+PrepareResult parse_on_conflict(Parser *parser) {
+  if (!expect_keyword(parser, "conflict") ||
+      !expect_token(parser, TOKEN_LEFT_PAREN) ||
+      !expect_keyword(parser, "id") ||
+      !expect_token(parser, TOKEN_RIGHT_PAREN) ||
+      !expect_keyword(parser, "do") || !expect_keyword(parser, "update")) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  return expect_end(parser);
+}
+
+// insert [or replace] <id> <username> <email> [on conflict(id) do update]
+PrepareResult parse_insert(Parser *parser, Statement *statement) {
+  statement->type = STATEMENT_INSERT;
+  statement->is_upsert = false;
+  Row *row = &(statement->row_to_insert);
+
+  next_value(parser);
+  if (token_is_keyword(&(parser->token), "or")) {
+    if (!expect_keyword(parser, "replace")) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    statement->is_upsert = true;
+    next_value(parser);
+  }
+
+  // all three values have to be there before any of them is judged
+  Token id = parser->token;
+  next_value(parser);
+  Token username = parser->token;
+  next_value(parser);
+  Token email = parser->token;
+  if (id.type == TOKEN_END || username.type == TOKEN_END ||
+      email.type == TOKEN_END) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  PrepareResult result = parse_id(&id, &(row->id));
+  if (result == PREPARE_SUCCESS) {
+    result = parse_string(&username, row->username, COLUMN_USERNAME_SIZE);
+  }
+  if (result == PREPARE_SUCCESS) {
+    result = parse_string(&email, row->email, COLUMN_EMAIL_SIZE);
+  }
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
+
+  next_token(parser);
+  if (token_is_keyword(&(parser->token), "on")) {
+    statement->is_upsert = true;
+    return parse_on_conflict(parser);
+  }
+  return parser->token.type == TOKEN_END ? PREPARE_SUCCESS
+                                         : PREPARE_SYNTAX_ERROR;
+}
+
+// update set username = <u>, email = <e> where id = <n>
+PrepareResult parse_update(Parser *parser, Statement *statement) {
+  statement->type = STATEMENT_UPDATE;
+  statement->set_username = false;
+  statement->set_email = false;
+  Row *new_values = &(statement->row_to_update);
+
+  if (!expect_keyword(parser, "set")) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  next_token(parser);
+  while (!token_is_keyword(&(parser->token), "where")) {
+    Token column = parser->token;
+    if (!expect_token(parser, TOKEN_EQUALS)) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    // lexed like an insert value, so punctuation is fine, except that a
+    // comma ends it: that's the one before the next assignment
+    next_value(parser);
+    Token *value = &(parser->token);
+    const char *comma = memchr(value->start, ',', value->length);
+    if (comma != NULL) {
+      value->length = comma - value->start;
+      value->type = value->length > 0 ? TOKEN_WORD : TOKEN_END;
+      parser->next = comma;
+    }
+
+    PrepareResult result;
+    if (token_is_keyword(&column, "username")) {
+      result = parse_string(&(parser->token), new_values->username,
+                            COLUMN_USERNAME_SIZE);
+      statement->set_username = true;
+    } else if (token_is_keyword(&column, "email")) {
+      result = parse_string(&(parser->token), new_values->email,
+                            COLUMN_EMAIL_SIZE);
+      statement->set_email = true;
+    } else {
+      result = PREPARE_SYNTAX_ERROR;
+    }
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+
+    // commas between assignments are optional
+    next_token(parser);
+    if (parser->token.type == TOKEN_COMMA) {
+      next_token(parser);
+    }
+  }
+
+  if (!statement->set_username && !statement->set_email) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  return parse_where(parser, statement);
+}
+
+// delete where id = <n>
+PrepareResult parse_delete(Parser *parser, Statement *statement) {
+  statement->type = STATEMENT_DELETE;
+  next_token(parser);
+  return parse_where(parser, statement);
+}
+
+// statements that are a single keyword and nothing else
+PrepareResult parse_keyword_statement(Parser *parser, Statement *statement,
+                                      StatementType type) {
+  statement->type = type;
+  return expect_end(parser);
+}
+
+PrepareResult parse_statement(Parser *parser, Statement *statement) {
+  next_token(parser);
+  Token *keyword = &(parser->token);
+
+  if (token_is_keyword(keyword, "select")) {
+    return parse_keyword_statement(parser, statement, STATEMENT_SELECT);
+  }
+  if (token_is_keyword(keyword, "insert")) {
+    return parse_insert(parser, statement);
+  }
+  if (token_is_keyword(keyword, "update")) {
+    return parse_update(parser, statement);
+  }
+  if (token_is_keyword(keyword, "delete")) {
+    return parse_delete(parser, statement);
+  }
+  if (token_is_keyword(keyword, "begin")) {
+    return parse_keyword_statement(parser, statement, STATEMENT_BEGIN);
+  }
+  if (token_is_keyword(keyword, "commit")) {
+    return parse_keyword_statement(parser, statement, STATEMENT_COMMIT);
+  }
+  if (token_is_keyword(keyword, "rollback")) {
+    return parse_keyword_statement(parser, statement, STATEMENT_ROLLBACK);
+  }
+
+  return PREPARE_UNRECOGNIZED_STATEMENT;
+}
+
+// Figures out where to read/write a particular row in memory
+void *get_row_location(Table *table, uint32_t row_num) {
+  // Calculate which page contains this row
+  uint32_t page_num = row_num / ROWS_PER_PAGE;
+
+  // Get a pointer to the start of the page, creating the page if it
+  // doesn't exist yet
+  void *page_start = get_page(table, page_num);
+
+  /*
+   * get row position by doing modulo %
+   * it's perfect for getting a "position"
+   *
+   * say ROWS_PER_PAGE = 10.
+   * if row_num is 0-9, % 10 will be those numbers (0-9)
+   * if row_num is 11, % 10 = 1 (first position in next page)
+   * if row_num is 15, % 10 = 5 (fifth position in next page)
+   * if row_num is 25, % 10 = 5 (fifth position in third page)
+   *
+   * So row_position_in_page always gives you the row's position within its
+   * specific page, regardless of which page it's on.
+   */
+  uint32_t row_position_in_page = row_num % ROWS_PER_PAGE;
+
+  // `row_position_in_page * ROW_SIZE` calculates how many bytes you need to
+  // move from the start of the page to its specific row
+  void *row_location = page_start + (row_position_in_page * ROW_SIZE);
+
+  return row_location;
+}
+
+/*
+ * Same as get_row_location, but for a row we're about to overwrite.
+ *
+ * Inside a transaction this saves the page's before-image the first time the
+ * page is touched, so a later ROLLBACK can put it back.
+ */
+void *get_row_location_for_write(Table *table, uint32_t row_num) {
+  Transaction *transaction = &table->transaction;
+  uint32_t page_num = row_num / ROWS_PER_PAGE;
+
+  if (transaction->is_open && transaction->undo_pages[page_num] == NULL &&
+      !transaction->is_new_page[page_num]) {
+    if (table->pages[page_num] == NULL) {
+      transaction->is_new_page[page_num] = true;
+    } else {
+      transaction->undo_pages[page_num] = malloc(PAGE_SIZE);
+      memcpy(transaction->undo_pages[page_num], table->pages[page_num],
+             PAGE_SIZE);
+    }
+  }
+
+  return get_row_location(table, row_num);
+}
+
+uint8_t *get_tombstone_bitmap(void *page) {
+  return (uint8_t *)page + TOMBSTONE_BITMAP_OFFSET;
+}
+
+bool is_slot_deleted(uint8_t *tombstones, uint32_t slot) {
+  return tombstones[slot / 8] & (1 << (slot % 8));
+}
+
+// true when every slot on the page is tombstoned, so scans can skip it
+bool is_page_all_deleted(uint8_t *tombstones) {
+  for (uint32_t slot = 0; slot < ROWS_PER_PAGE; slot++) {
+    if (!is_slot_deleted(tombstones, slot)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool is_row_deleted(Table *table, uint32_t row_num) {
+  uint8_t *tombstones =
+      get_tombstone_bitmap(table->pages[row_num / ROWS_PER_PAGE]);
+  return is_slot_deleted(tombstones, row_num % ROWS_PER_PAGE);
+}
+
+uint64_t *get_begin_stamps(void *page) {
+  return (uint64_t *)((uint8_t *)page + BEGIN_STAMPS_OFFSET);
+}
+
+uint64_t *get_end_stamps(void *page) {
+  return (uint64_t *)((uint8_t *)page + END_STAMPS_OFFSET);
+}
+
+bool is_version_visible(uint64_t begin, uint64_t end, uint64_t snapshot) {
+  return begin <= snapshot && (end == 0 || end > snapshot);
+}
+
+// the stamp the writes being made now get: the commit that'll show them
+uint64_t write_stamp(Table *table) { return table->commit_stamp + 1; }
+
+void set_version_stamps(Table *table, uint32_t row_num, uint64_t begin,
+                        uint64_t end) {
+  void *page = table->pages[row_num / ROWS_PER_PAGE];
+  get_begin_stamps(page)[row_num % ROWS_PER_PAGE] = begin;
+  get_end_stamps(page)[row_num % ROWS_PER_PAGE] = end;
+}
+
+uint64_t get_begin_stamp(Table *table, uint32_t row_num) {
+  void *page = table->pages[row_num / ROWS_PER_PAGE];
+  return get_begin_stamps(page)[row_num % ROWS_PER_PAGE];
+}
+
+// 0 while the version is current
+uint64_t get_end_stamp(Table *table, uint32_t row_num) {
+  void *page = table->pages[row_num / ROWS_PER_PAGE];
+  return get_end_stamps(page)[row_num % ROWS_PER_PAGE];
+}
+
+// atomic, like the tombstone bits, since appenders on other threads may be
+// tombstoning slots on the same page (see execute_append)
+void set_page_has_free_slot(Table *table, uint32_t page_num, bool has_free) {
+  uint64_t bit = (uint64_t)1 << (page_num % 64);
+  if (has_free) {
+    __atomic_fetch_or(&table->free_space_map[page_num / 64], bit,
+                      __ATOMIC_SEQ_CST);
+  } else {
+    __atomic_fetch_and(&table->free_space_map[page_num / 64], ~bit,
+                       __ATOMIC_SEQ_CST);
+  }
+}
+
+// true if the page has any tombstoned slot
+bool page_has_free_slot(Table *table, uint32_t page_num) {
+  uint8_t *tombstones = get_tombstone_bitmap(table->pages[page_num]);
+  for (uint32_t i = 0; i < TOMBSTONE_BITMAP_SIZE; i++) {
+    if (tombstones[i] != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// recomputes the free-space map from the tombstone bitmaps, e.g. after a
+// rollback has swapped whole pages back in
+void rebuild_free_space_map(Table *table) {
+  for (uint32_t i = 0; i < FREE_SPACE_MAP_WORDS; i++) {
+    table->free_space_map[i] = 0;
+  }
+  for (uint32_t page_num = 0; page_num < TABLE_MAX_PAGES; page_num++) {
+    if (table->pages[page_num] != NULL) {
+      set_page_has_free_slot(table, page_num,
+                             page_has_free_slot(table, page_num));
+    }
+  }
+}
+
+/*
+ * Finds a deleted slot that an insert can reuse.
+ *
+ * __builtin_ctzll counts trailing zeros, i.e. gives the index of the lowest
+ * set bit, so each 64-bit word of the map is checked in one instruction.
+ */
+bool find_free_slot(Table *table, uint32_t *row_num) {
+  for (uint32_t word = 0; word < FREE_SPACE_MAP_WORDS; word++) {
+    if (table->free_space_map[word] == 0) {
+      continue;
+    }
+    uint32_t page_num =
+        word * 64 + __builtin_ctzll(table->free_space_map[word]);
+
+    uint8_t *tombstones = get_tombstone_bitmap(table->pages[page_num]);
+    for (uint32_t slot = 0; slot < ROWS_PER_PAGE; slot++) {
+      if (is_slot_deleted(tombstones, slot)) {
+        *row_num = page_num * ROWS_PER_PAGE + slot;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// id of the row stored at row_num, without deserializing the whole row
+uint32_t get_row_id(Table *table, uint32_t row_num) {
+  uint32_t id;
+  memcpy(&id, get_row_location(table, row_num) + ID_OFFSET, ID_SIZE);
+  return id;
+}
+
+void add_dead_version(Table *table, uint32_t row_num) {
+  if (table->num_dead_versions == table->dead_versions_capacity) {
+    table->dead_versions_capacity = table->dead_versions_capacity > 0
+                                        ? table->dead_versions_capacity * 2
+                                        : 16;
+    table->dead_versions =
+        realloc(table->dead_versions,
+                table->dead_versions_capacity * sizeof(uint32_t));
+  }
+  table->dead_versions[table->num_dead_versions++] = row_num;
+}
+
+// throws the index away and re-adds every current row, e.g. after a
+// rollback has swapped whole pages back in. The ended versions still
+// waiting to be collected are found again on the way
+void rebuild_index(Table *table) {
+  free_index(table->index);
+  table->index = new_index_node(true);
+  table->num_dead_versions = 0;
+
+  uint32_t existing_row_num;
+  for (uint32_t row_num = 0; row_num < table->num_rows; row_num++) {
+    if (is_row_deleted(table, row_num)) {
+      continue;
+    }
+    if (get_end_stamp(table, row_num) != 0) {
+      add_dead_version(table, row_num);
+    } else {
+      index_insert(&table->index, get_row_id(table, row_num), row_num,
+                   &existing_row_num);
+    }
+  }
+}
+
+void clear_tombstone(Table *table, uint32_t row_num) {
+  uint32_t page_num = row_num / ROWS_PER_PAGE;
+  uint32_t slot = row_num % ROWS_PER_PAGE;
+  uint8_t *tombstones = get_tombstone_bitmap(table->pages[page_num]);
+  __atomic_fetch_and(&tombstones[slot / 8], (uint8_t) ~(1 << (slot % 8)),
+                     __ATOMIC_SEQ_CST);
+  set_page_has_free_slot(table, page_num, page_has_free_slot(table, page_num));
+}
+
+void set_tombstone(Table *table, uint32_t row_num) {
+  uint32_t page_num = row_num / ROWS_PER_PAGE;
+  uint32_t slot = row_num % ROWS_PER_PAGE;
+  uint8_t *tombstones = get_tombstone_bitmap(table->pages[page_num]);
+  __atomic_fetch_or(&tombstones[slot / 8], (uint8_t)(1 << (slot % 8)),
+                    __ATOMIC_SEQ_CST);
+  set_page_has_free_slot(table, page_num, true);
+}
+
+// how many tombstoned slots there are, i.e. how much vacuum could reclaim
+uint32_t count_deleted_rows(Table *table) {
+  uint32_t num_deleted = 0;
+  for (uint32_t page_num = 0; page_num < TABLE_MAX_PAGES; page_num++) {
+    if (!(table->free_space_map[page_num / 64] &
+          ((uint64_t)1 << (page_num % 64)))) {
+      continue;
+    }
+    uint8_t *tombstones = get_tombstone_bitmap(table->pages[page_num]);
+    for (uint32_t i = 0; i < TOMBSTONE_BITMAP_SIZE; i++) {
+      num_deleted += __builtin_popcount(tombstones[i]);
+    }
+  }
+  return num_deleted;
+}
+
+/*
+ * True when nobody can be holding a snapshot, so a version can just be
+ * overwritten or freed on the spot (or moved by vacuum), since there's no
+ * one left to see the old one.
+ *
+ * That's when no scan is open, but a reader handle can open one at any
+ * moment. So the writer raises is_overwriting before it looks, and a
+ * reader's scan counts itself before it waits for is_overwriting to drop
+ * (see open_scan): one of them always sees the other. Once raised it stays
+ * up until the statement is committed (see end_overwrites), so no
+ * snapshot can be taken between the write and its commit.
+ *
+ * Inside a transaction that would be until COMMIT, which readers shouldn't
+ * have to wait for, so there it also takes there being no reader handles.
+ */
+bool can_overwrite_versions(Table *table) {
+  if (table->transaction.is_open) {
+    return __atomic_load_n(&table->num_open_scans, __ATOMIC_ACQUIRE) == 0 &&
+           __atomic_load_n(&table->num_reader_handles, __ATOMIC_ACQUIRE) == 0;
+  }
+  if (__atomic_load_n(&table->is_overwriting, __ATOMIC_RELAXED)) {
+    return true;
+  }
+  __atomic_store_n(&table->is_overwriting, true, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&table->num_open_scans, __ATOMIC_SEQ_CST) == 0) {
+    return true;
+  }
+  __atomic_store_n(&table->is_overwriting, false, __ATOMIC_RELEASE);
+  return false;
+}
+
+// the writer's statement is committed, so readers can take snapshots again
+void end_overwrites(Table *table) {
+  if (__atomic_load_n(&table->is_overwriting, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&table->is_overwriting, false, __ATOMIC_RELEASE);
+  }
+}
+
+/*
+ * The oldest snapshot an open scan could have. The commit stamp is read
+ * before the slots, so a scan that registers after we've looked took its
+ * snapshot after that and is no older than the stamp (see take_snapshot).
+ */
+uint64_t oldest_snapshot(Table *table) {
+  uint64_t oldest = __atomic_load_n(&table->commit_stamp, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&table->num_unslotted_scans, __ATOMIC_SEQ_CST) > 0) {
+    return 0;
+  }
+  for (uint32_t i = 0; i < MAX_SNAPSHOT_SLOTS; i++) {
+    uint64_t snapshot =
+        __atomic_load_n(&table->snapshots[i], __ATOMIC_SEQ_CST);
+    if (snapshot != 0 && snapshot < oldest) {
+      oldest = snapshot;
+    }
+  }
+  return oldest;
+}
+
+// tombstones the ended versions no snapshot can see any more, so inserts
+// can have their slots
+void collect_garbage(Table *table) {
+  if (table->num_dead_versions == 0) {
+    return;
+  }
+  // a version ended by a commit after this is visible to somebody (or not
+  // committed at all)
+  uint64_t oldest = oldest_snapshot(table);
+  uint32_t num_kept = 0;
+  for (uint32_t i = 0; i < table->num_dead_versions; i++) {
+    uint32_t row_num = table->dead_versions[i];
+    if (get_end_stamp(table, row_num) <= oldest) {
+      // inside a transaction a rollback brings the version back, and
+      // rebuild_index finds it again
+      get_row_location_for_write(table, row_num);
+      begin_page_write(table, row_num / ROWS_PER_PAGE);
+      set_tombstone(table, row_num);
+      end_page_write(table, row_num / ROWS_PER_PAGE);
+    } else {
+      table->dead_versions[num_kept++] = row_num;
+    }
+  }
+  table->num_dead_versions = num_kept;
+}
+
+/*
+ * How far into the table open scans go: the furthest end_row_num of any
+ * registered snapshot, or all of it while a scan has no slot. A scan that
+ * registers while we look may go further, but only up to rows it can't
+ * see (see set_num_rows), and a reader copes with the rows going away
+ * under it (see read_next_row).
+ */
+uint32_t scanned_rows_end(Table *table) {
+  if (__atomic_load_n(&table->num_unslotted_scans, __ATOMIC_SEQ_CST) > 0) {
+    return table->num_rows;
+  }
+  uint32_t end = 0;
+  for (uint32_t i = 0; i < MAX_SNAPSHOT_SLOTS; i++) {
+    if (__atomic_load_n(&table->snapshots[i], __ATOMIC_SEQ_CST) == 0) {
+      continue;
+    }
+    uint32_t end_row_num =
+        __atomic_load_n(&table->snapshot_end_rows[i], __ATOMIC_ACQUIRE);
+    if (end_row_num > end) {
+      end = end_row_num;
+    }
+  }
+  return end;
+}
+
+/*
+ * Drops tombstoned rows off the end of the table and releases pages that
+ * end up empty. Since the pages live in memory, "releasing" is a free();
+ * it's the in-memory version of truncating the file.
+ *
+ * Open scans don't stop it, but it never goes below where one of them
+ * stops, so their cursors never land on a released page.
+ */
+void truncate_deleted_tail(Table *table) {
+  uint32_t floor = scanned_rows_end(table);
+  while (table->num_rows > floor &&
+         is_row_deleted(table, table->num_rows - 1)) {
+    uint32_t page_num = (table->num_rows - 1) / ROWS_PER_PAGE;
+    begin_page_write(table, page_num);
+    clear_tombstone(table, table->num_rows - 1);
+    set_num_rows(table, table->num_rows - 1);
+    end_page_write(table, page_num);
+
+    if (table->num_rows % ROWS_PER_PAGE == 0) {
+      retire_page(table, page_num);
+      set_page_has_free_slot(table, page_num, false);
+    }
+  }
+}
+
+// writes `row` into the slot claim_slot handed out, as a current version
+void write_version(Table *table, uint32_t row_num, Row *row) {
+  void *row_location = get_row_location_for_write(table, row_num);
+  begin_page_write(table, row_num / ROWS_PER_PAGE);
+  serialize_row(row, row_location);
+  set_version_stamps(table, row_num, write_stamp(table), 0);
+  table->has_uncommitted_writes = true;
+  if (row_num == table->num_rows) {
+    set_num_rows(table, table->num_rows + 1);
+  } else {
+    clear_tombstone(table, row_num);
+  }
+  end_page_write(table, row_num / ROWS_PER_PAGE);
+}
+
+// a delete, or an update that wrote a newer version: the version stops
+// being current, and its slot is freed once nobody can see it
+void end_version(Table *table, uint32_t row_num) {
+  bool is_freed = can_overwrite_versions(table);
+  // goes through the _for_write path so a rollback can bring it back
+  get_row_location_for_write(table, row_num);
+  begin_page_write(table, row_num / ROWS_PER_PAGE);
+  get_end_stamps(table->pages[row_num / ROWS_PER_PAGE])
+      [row_num % ROWS_PER_PAGE] = write_stamp(table);
+  table->has_uncommitted_writes = true;
+  if (is_freed) {
+    set_tombstone(table, row_num);
+  }
+  end_page_write(table, row_num / ROWS_PER_PAGE);
+  if (!is_freed) {
+    add_dead_version(table, row_num);
+  }
+}
+
+/*
+ * Makes everything written with write_stamp visible to snapshots taken
+ * from now on, in one store. Versions ended before that may now be out of
+ * every snapshot's sight.
+ */
+void publish_commit(Table *table) {
+  __atomic_store_n(&table->commit_stamp, table->commit_stamp + 1,
+                   __ATOMIC_SEQ_CST);
+  table->has_uncommitted_writes = false;
+  collect_garbage(table);
+}
+
+/*
+ * Vacuum's move of a live row while scans are open: a scan could come
+ * across a row moved in place in both its slots, or in neither, so it's
+ * written to the hole as a new version and the old one is ended, like an
+ * update. collect_garbage frees the old slot once nobody can see it, and
+ * the next step truncates it away. Vacuum never runs in a transaction, so
+ * the move is committed straight away.
+ */
+void move_row_version(Table *table, uint32_t row_num, uint32_t hole) {
+  Row row;
+  deserialize_row(get_row_location(table, row_num), &row);
+  write_version(table, hole, &row);
+  end_version(table, row_num);
+  index_set(&table->index, row.id, hole);
+  publish_commit(table);
+}
+
+// the last row at or below `row_num` that's live, rather than deleted or
+// ended. false if there's none above `hole`
+bool find_last_live_row(Table *table, uint32_t hole, uint32_t *row_num) {
+  while (*row_num > hole) {
+    if (!is_row_deleted(table, *row_num) &&
+        get_end_stamp(table, *row_num) == 0) {
+      return true;
+    }
+    *row_num -= 1;
+  }
+  return false;
+}
+
+/*
+ * One bounded unit of vacuum work: moves at most `max_rows_moved` live rows
+ * from the end of the table into holes left by deletes, then truncates the
+ * dead tail.
+ *
+ * Keeping each step small is what makes it safe to run in between
+ * statements: a step never costs more than a handful of row copies, no
+ * matter how much garbage the table has.
+ *
+ * Returns true if there's still work left for another step.
+ */
+bool vacuum_step(Table *table, uint32_t max_rows_moved) {
+  collect_garbage(table);
+  uint32_t rows_moved = 0;
+  // where to look for the next row to move while scans are open, past the
+  // versions ended by earlier moves
+  uint32_t last_live_row = UINT32_MAX;
+  while (true) {
+    truncate_deleted_tail(table);
+
+    uint32_t hole;
+    if (!find_free_slot(table, &hole)) {
+      return false;
+    }
+    if (rows_moved == max_rows_moved) {
+      return true;
+    }
+
+    if (!can_overwrite_versions(table)) {
+      if (last_live_row > table->num_rows - 1) {
+        last_live_row = table->num_rows - 1;
+      }
+      if (!find_last_live_row(table, hole, &last_live_row)) {
+        return false;
+      }
+      move_row_version(table, last_live_row, hole);
+      rows_moved += 1;
+      continue;
+    }
+
+    // after the truncate the last row is live and the hole sits before it
+    uint32_t last_row = table->num_rows - 1;
+    uint64_t end = get_end_stamp(table, last_row);
+    begin_page_write(table, hole / ROWS_PER_PAGE);
+    memcpy(get_row_location(table, hole), get_row_location(table, last_row),
+           ROW_SIZE);
+    set_version_stamps(table, hole, get_begin_stamp(table, last_row), end);
+    clear_tombstone(table, hole);
+    end_page_write(table, hole / ROWS_PER_PAGE);
+    begin_page_write(table, last_row / ROWS_PER_PAGE);
+    set_tombstone(table, last_row);
+    end_page_write(table, last_row / ROWS_PER_PAGE);
+
+    if (end == 0) {
+      index_set(&table->index, get_row_id(table, hole), hole);
+    } else {
+      // an ended version somebody still needs moves like any other
+      for (uint32_t i = 0; i < table->num_dead_versions; i++) {
+        if (table->dead_versions[i] == last_row) {
+          table->dead_versions[i] = hole;
+        }
+      }
+    }
+    rows_moved += 1;
+  }
+}
+
+/*
+ * Vacuum that piggybacks on write statements: once at least a page worth
+ * of rows, and a quarter of the table, is dead, every write does one small
+ * vacuum step. It never runs inside a transaction since a rollback would
+ * undo the moves anyway. Open selects don't stop it; rows just move as new
+ * versions while they're open (see move_row_version).
+ */
+#define VACUUM_STEP_ROWS 16
+
+void autovacuum(Table *table) {
+  if (table->transaction.is_open) {
+    return;
+  }
+  uint32_t num_deleted = count_deleted_rows(table);
+  if (num_deleted >= ROWS_PER_PAGE && num_deleted * 4 >= table->num_rows) {
+    vacuum_step(table, VACUUM_STEP_ROWS);
+  }
+}
+
+// where a new version goes: a hole left by a delete if there is one,
+// otherwise the end of the table. false if the table is full
+bool claim_slot(Table *table, uint32_t *row_num) {
+  if (find_free_slot(table, row_num)) {
+    return true;
+  }
+  if (table->num_rows == TABLE_MAX_ROWS) {
+    return false;
+  }
+  *row_num = table->num_rows;
+  return true;
+}
+
+/*
+ * Rows are fixed width, so when nobody can be looking an update just
+ * overwrites the columns in place. Otherwise it writes a new version of
+ * the row in a slot of its own and ends the old one, which open scans
+ * keep seeing.
+ */
+ExecuteResult update_row(Table *table, uint32_t row_num, Row *new_values,
+                         bool set_username, bool set_email) {
+  if (can_overwrite_versions(table)) {
+    void *row_location = get_row_location_for_write(table, row_num);
+    begin_page_write(table, row_num / ROWS_PER_PAGE);
+    if (set_username) {
+      memcpy(row_location + USERNAME_OFFSET, new_values->username,
+             USERNAME_SIZE);
+    }
+    if (set_email) {
+      memcpy(row_location + EMAIL_OFFSET, new_values->email, EMAIL_SIZE);
+    }
+    set_version_stamps(table, row_num, write_stamp(table), 0);
+    table->has_uncommitted_writes = true;
+    end_page_write(table, row_num / ROWS_PER_PAGE);
+    return EXECUTE_SUCCESS;
+  }
+
+  Row row;
+  deserialize_row(get_row_location(table, row_num), &row);
+  if (set_username) {
+    memcpy(row.username, new_values->username, USERNAME_SIZE);
+  }
+  if (set_email) {
+    memcpy(row.email, new_values->email, EMAIL_SIZE);
+  }
+  uint32_t new_row_num;
+  if (!claim_slot(table, &new_row_num)) {
+    return EXECUTE_TABLE_FULL;
+  }
+  write_version(table, new_row_num, &row);
+  end_version(table, row_num);
+  index_set(&table->index, row.id, new_row_num);
+  return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_insert(Statement *statement, Table *table) {
+  Row *row_to_insert = &(statement->row_to_insert);
+  uint32_t existing_row_num;
+
+  uint32_t row_num;
+  if (!claim_slot(table, &row_num)) {
+    // no room for a new row, but an upsert of an existing id still works
+    // (if it can be done in place)
+    if (statement->is_upsert &&
+        index_find(&table->index, row_to_insert->id, &existing_row_num)) {
+      return update_row(table, existing_row_num, row_to_insert, true, true);
+    }
+    return EXECUTE_TABLE_FULL;
+  }
+
+  // one probe of the index both checks for the id and claims it
+  if (!index_insert(&table->index, row_to_insert->id, row_num,
+                    &existing_row_num)) {
+    if (!statement->is_upsert) {
+      return EXECUTE_DUPLICATE_KEY;
+    }
+    // a new version may well go in the slot we just claimed; nothing's
+    // been written there yet
+    return update_row(table, existing_row_num, row_to_insert, true, true);
+  }
+
+  write_version(table, row_num, row_to_insert);
+  return EXECUTE_SUCCESS;
+}
+
+/*
+ * Puts the buffer's rows in the table, in the slots after whatever's been
+ * reserved so far, and points their ids in the index at them. With an
+ * append in flight (see
+ * enter_append) on the appender's thread, or with the gate closed on the
+ * writer's.
+ *
+ * The rows are all written before any of them is published, so a scan
+ * either sees the whole flush or none of it.
+ */
+void flush_append_buffer(Table *table, AppendBuffer *buffer) {
+  uint32_t num_rows = buffer->num_rows;
+  if (num_rows > 0) {
+    // can't go past the end of the table: these slots were promised
+    uint32_t first_row_num = __atomic_fetch_add(&table->num_reserved_rows,
+                                                num_rows, __ATOMIC_RELAXED);
+    // nothing the writer does can commit while we're here, so this is the
+    // latest commit for the whole of the flush
+    uint64_t stamp = __atomic_load_n(&table->commit_stamp, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < num_rows; i++) {
+      serialize_row(&buffer->rows[i],
+                    get_row_location(table, first_row_num + i));
+      set_version_stamps(table, first_row_num + i, stamp, 0);
+      index_set(&table->index, buffer->rows[i].id, first_row_num + i);
+    }
+    publish_rows(table, first_row_num, num_rows);
+  }
+  buffer->num_rows = 0;
+}
+
+/*
+ * Closes the appends gate (see enter_append), waits out the appends already
+ * in flight and flushes every appender's buffer, so the table and its index
+ * are all the writer's. Only on the writer's thread; it can be closed more
+ * than once, and opens again when every block is undone.
+ */
+void block_appends(Table *table) {
+  if (__atomic_add_fetch(&table->are_appends_blocked, 1, __ATOMIC_SEQ_CST) >
+      1) {
+    // already closed, and flushed when it was
+    return;
+  }
+  while (__atomic_load_n(&table->num_active_appends, __ATOMIC_SEQ_CST) > 0) {
+    sched_yield();
+  }
+  for (uint32_t i = 0; i < MAX_READERS; i++) {
+    AppendBuffer *buffer = __atomic_load_n(
+        &table->reader_slots[i].append_buffer, __ATOMIC_ACQUIRE);
+    if (buffer != NULL) {
+      flush_append_buffer(table, buffer);
+    }
+  }
+}
+
+void unblock_appends(Table *table) {
+  __atomic_sub_fetch(&table->are_appends_blocked, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * An insert on an appender handle, on the appender's own thread. It runs
+ * alongside other appends, scans and the writer's selects without taking
+ * a lock on the table (see "Appenders" above), and goes at the end even if
+ * there are holes, since handing those out is the writer's business.
+ *
+ * The row only goes in the appender's buffer, and into the table when that
+ * fills up or is flushed. Its id goes in the index now though, pending, so
+ * another append of the same id fails straight away, the same as if the
+ * row were in the table already.
+ */
+ExecuteResult execute_append(Statement *statement) {
+  Table *table = statement->db->table;
+  AppendBuffer *buffer = statement->db->append_buffer;
+  Row *row_to_insert = &(statement->row_to_insert);
+  enter_append(table);
+
+  if (buffer->num_rows == APPEND_BUFFER_ROWS) {
+    flush_append_buffer(table, buffer);
+  }
+  if (!promise_row(table)) {
+    exit_append(table);
+    return EXECUTE_TABLE_FULL;
+  }
+
+  uint32_t existing_row_num;
+  if (!index_insert(&table->index, row_to_insert->id, PENDING_ROW_NUM,
+                    &existing_row_num)) {
+    // the slot goes back for somebody else's row
+    __atomic_sub_fetch(&table->num_promised_rows, 1, __ATOMIC_RELAXED);
+    exit_append(table);
+    return EXECUTE_DUPLICATE_KEY;
+  }
+  buffer->rows[buffer->num_rows] = *row_to_insert;
+  buffer->num_rows += 1;
+  exit_append(table);
+  return EXECUTE_SUCCESS;
+}
+
+// past the rows in the cursor's snapshot, or the end of the table if vacuum
+// has truncated it since
+bool cursor_end_of_table(Cursor *cursor) {
+  return cursor->row_num >= cursor->end_row_num ||
+         cursor->row_num >= get_num_rows(cursor->table);
+}
+
+// moves the cursor forward until it's on a row version in its snapshot
+// (or past the end)
+void cursor_skip_deleted(Cursor *cursor) {
+  Table *table = cursor->table;
+  while (!cursor_end_of_table(cursor)) {
+    void *page = table->pages[cursor->row_num / ROWS_PER_PAGE];
+    uint8_t *tombstones = get_tombstone_bitmap(page);
+    uint32_t slot = cursor->row_num % ROWS_PER_PAGE;
+
+    // a page that's nothing but tombstones is skipped in one go
+    if (slot == 0 && is_page_all_deleted(tombstones)) {
+      cursor->row_num += ROWS_PER_PAGE;
+      continue;
+    }
+    if (!is_slot_deleted(tombstones, slot) &&
+        is_version_visible(get_begin_stamps(page)[slot],
+                           get_end_stamps(page)[slot], cursor->snapshot)) {
+      return;
+    }
+    cursor->row_num += 1;
+  }
+}
+
+Cursor table_start(Table *table, uint64_t snapshot, uint32_t end_row_num) {
+  Cursor cursor;
+  cursor.table = table;
+  cursor.row_num = 0;
+  cursor.snapshot = snapshot;
+  cursor.end_row_num = end_row_num;
+  cursor_skip_deleted(&cursor);
+  return cursor;
+}
+
+void *cursor_value(Cursor *cursor) {
+  return get_row_location(cursor->table, cursor->row_num);
+}
+
+void cursor_advance(Cursor *cursor) {
+  cursor->row_num += 1;
+  cursor_skip_deleted(cursor);
+}
+
+/*
+ * A reader's cursor_skip_deleted and cursor_value in one: finds the first
+ * row version in `snapshot` at or after `*row_num` and copies it into
+ * `copy` (a Row is laid out just like a row in a page). If the page was
+ * written while we were copying from it, we just look again. false once
+ * it's past `end_row_num` or the end of the table.
+ */
+bool read_next_row(Table *table, uint32_t *row_num, uint64_t snapshot,
+                   uint32_t end_row_num, Row *copy) {
+  while (*row_num < end_row_num) {
+    uint32_t page_num = *row_num / ROWS_PER_PAGE;
+    uint32_t slot = *row_num % ROWS_PER_PAGE;
+    uint32_t *version = &table->page_versions[page_num];
+
+    uint32_t version_before = __atomic_load_n(version, __ATOMIC_ACQUIRE);
+    if (version_before % 2 == 1) {
+      // the writer's in the middle of the page; give it the core rather
+      // than spin on it, in case it's the one waiting for it
+      sched_yield();
+      continue;
+    }
+    if (*row_num >= __atomic_load_n(&table->num_rows, __ATOMIC_ACQUIRE)) {
+      return false;
+    }
+    void *page = __atomic_load_n(&table->pages[page_num], __ATOMIC_SEQ_CST);
+    if (page == NULL) {
+      // truncated away; num_rows will say so next time round
+      continue;
+    }
+    uint8_t tombstones[TOMBSTONE_BITMAP_SIZE];
+    memcpy(tombstones, get_tombstone_bitmap(page), TOMBSTONE_BITMAP_SIZE);
+    uint64_t begin = get_begin_stamps(page)[slot];
+    uint64_t end = get_end_stamps(page)[slot];
+    memcpy(copy, page + slot * ROW_SIZE, ROW_SIZE);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(version, __ATOMIC_RELAXED) != version_before) {
+      continue;
+    }
+
+    if (slot == 0 && is_page_all_deleted(tombstones)) {
+      *row_num += ROWS_PER_PAGE;
+    } else if (is_slot_deleted(tombstones, slot) ||
+               !is_version_visible(begin, end, snapshot)) {
+      *row_num += 1;
+    } else {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * A select checks whether it should stop (see db_interrupt) only once
+ * every INTERRUPT_CHECK_PAGES pages: that's one compare per row, and a
+ * clock read every hundred or so rows if it has a timeout.
+ */
+#define INTERRUPT_CHECK_PAGES 8
+
+uint64_t monotonic_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// EXECUTE_ROW if the scan can carry on, or why it has to stop
+ExecuteResult check_interrupt(Statement *statement) {
+  if (statement->cursor.row_num < statement->next_check_row) {
+    return EXECUTE_ROW;
+  }
+  if (__atomic_load_n(&statement->is_cancelled, __ATOMIC_RELAXED) ||
+      __atomic_load_n(&statement->db->num_interrupts, __ATOMIC_RELAXED) !=
+          statement->num_interrupts_at_prepare) {
+    return EXECUTE_INTERRUPTED;
+  }
+  if (statement->deadline != 0 && monotonic_ns() >= statement->deadline) {
+    return EXECUTE_TIMED_OUT;
+  }
+
+  // the next check is on the first row of a page a few pages on
+  uint32_t page_num = statement->cursor.row_num / ROWS_PER_PAGE;
+  statement->next_check_row =
+      (page_num + INTERRUPT_CHECK_PAGES) * ROWS_PER_PAGE;
+  return EXECUTE_ROW;
+}
+
+/*
+ * Hands out the next live row, one per call. Nothing is copied: the
+ * statement just points at the row in its page until the next call.
+ */
+ExecuteResult execute_select(Statement *statement) {
+  Cursor *cursor = &(statement->cursor);
+  if (cursor_end_of_table(cursor)) {
+    return EXECUTE_SUCCESS;
+  }
+
+  statement->current_row = cursor_value(cursor);
+  cursor_advance(cursor);
+  return EXECUTE_ROW;
+}
+
+// execute_select for a statement on a reader handle, which hands out a
+// copy of the row instead
+ExecuteResult execute_select_copy(Statement *statement) {
+  DB *reader = statement->db;
+  Cursor *cursor = &(statement->cursor);
+  enter_epoch(reader);
+  bool has_row =
+      read_next_row(reader->table, &cursor->row_num, cursor->snapshot,
+                    cursor->end_row_num, &statement->row_copy);
+  exit_epoch(reader);
+  if (!has_row) {
+    return EXECUTE_SUCCESS;
+  }
+
+  statement->current_row = &statement->row_copy;
+  cursor->row_num += 1;
+  return EXECUTE_ROW;
+}
+
+ExecuteResult execute_update(Statement *statement, Table *table) {
+  uint32_t row_num;
+  if (index_find(&table->index, statement->where_id, &row_num)) {
+    return update_row(table, row_num, &(statement->row_to_update),
+                      statement->set_username, statement->set_email);
+  }
+  return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_delete(Statement *statement, Table *table) {
+  uint32_t row_num;
+  if (index_find(&table->index, statement->where_id, &row_num)) {
+    end_version(table, row_num);
+    index_remove(&table->index, statement->where_id);
+  }
+
+  autovacuum(table);
+  return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_begin(Table *table) {
+  Transaction *transaction = &table->transaction;
+  if (transaction->is_open) {
+    return EXECUTE_TRANSACTION_ALREADY_OPEN;
+  }
+
+  transaction->is_open = true;
+  transaction->num_rows_at_begin = table->num_rows;
+  // a rollback puts whole pages back, so appends wait for the transaction
+  // to end rather than go in and be rolled back with it
+  block_appends(table);
+  return EXECUTE_SUCCESS;
+}
+
+// outside a transaction, every write is a commit of its own. A statement
+// that didn't write anything (a duplicate key, a full table, an update of
+// an id that isn't there) leaves the stamp where it is
+ExecuteResult autocommit(Table *table, ExecuteResult result) {
+  if (!table->transaction.is_open && table->has_uncommitted_writes) {
+    publish_commit(table);
+  }
+  return result;
+}
+
+ExecuteResult execute_commit(Table *table) {
+  Transaction *transaction = &table->transaction;
+  if (!transaction->is_open) {
+    return EXECUTE_NO_TRANSACTION;
+  }
+
+  // the rows are already in their pages, so committing is just forgetting how
+  // to undo them and bumping the stamp they were written with
+  discard_undo_pages(transaction);
+  transaction->is_open = false;
+  publish_commit(table);
+  unblock_appends(table);
+
+  autovacuum(table);
+  return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_rollback(Table *table) {
+  Transaction *transaction = &table->transaction;
+  if (!transaction->is_open) {
+    return EXECUTE_NO_TRANSACTION;
+  }
+
+  set_num_rows(table, transaction->num_rows_at_begin);
+  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+    if (transaction->undo_pages[i] != NULL) {
+      begin_page_write(table, i);
+      memcpy(table->pages[i], transaction->undo_pages[i], PAGE_SIZE);
+      end_page_write(table, i);
+    } else if (transaction->is_new_page[i]) {
+      retire_page(table, i);
+    }
+  }
+  rebuild_free_space_map(table);
+  rebuild_index(table);
+
+  discard_undo_pages(transaction);
+  transaction->is_open = false;
+  unblock_appends(table);
+  return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_statement(Statement *statement, Table *table) {
+  switch (statement->type) {
+  case (STATEMENT_SELECT):
+    return execute_select(statement);
+  case (STATEMENT_INSERT):
+    return autocommit(table, execute_insert(statement, table));
+  case (STATEMENT_UPDATE):
+    return autocommit(table, execute_update(statement, table));
+  case (STATEMENT_DELETE):
+    return autocommit(table, execute_delete(statement, table));
+  case (STATEMENT_BEGIN):
+    return execute_begin(table);
+  case (STATEMENT_COMMIT):
+    return execute_commit(table);
+  case (STATEMENT_ROLLBACK):
+    return execute_rollback(table);
+  }
+}
+
+/*
+ * .import and .export split their work into chunks and give each chunk its
+ * own thread, up to one per CPU.
+ */
+#define MAX_WORKER_THREADS 8
+
+// how many threads to use for `num_chunks_wanted` pieces of work
+uint32_t worker_thread_count(uint32_t num_chunks_wanted) {
+  uint32_t num_threads = num_chunks_wanted;
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_cpus > 0 && num_threads > num_cpus) {
+    num_threads = num_cpus;
+  }
+  if (num_threads > MAX_WORKER_THREADS) {
+    num_threads = MAX_WORKER_THREADS;
+  }
+  return num_threads > 0 ? num_threads : 1;
+}
+
+// runs `work` on each of the `num_chunks` chunks (each `chunk_size` bytes)
+// on its own thread. The calling thread takes the first chunk itself, and
+// any chunk it couldn't start a thread for (say, at the process's thread
+// limit)
+void run_on_worker_threads(void *chunks, size_t chunk_size,
+                           uint32_t num_chunks, void *(*work)(void *)) {
+  pthread_t threads[MAX_WORKER_THREADS];
+  bool is_started[MAX_WORKER_THREADS] = {false};
+  for (uint32_t i = 1; i < num_chunks; i++) {
+    is_started[i] = pthread_create(&threads[i], NULL, work,
+                                   (char *)chunks + i * chunk_size) == 0;
+  }
+  work(chunks);
+  for (uint32_t i = 1; i < num_chunks; i++) {
+    if (is_started[i]) {
+      pthread_join(threads[i], NULL);
+    } else {
+      work((char *)chunks + i * chunk_size);
+    }
+  }
+}
+
+/*
+ * Bulk import from a CSV (or, for *.tsv, tab separated) file with one
+ * `id,username,email` row per line.
+ *
+ * The file is mmap'd and cut into chunks at line boundaries, one per
+ * worker thread. It then takes three passes, each one run by all the
+ * workers in parallel:
+ *
+ *   1. count the rows in each chunk. Added up, that says exactly which
+ *      row_num every chunk's first row gets, and all the pages the import
+ *      needs are allocated up front.
+ *   2. parse and validate each row (same rules as insert) and serialize it
+ *      straight into its slot. Chunks own disjoint slots, so the workers
+ *      never need a lock.
+ *   3. add each row to the index, which takes inserts from several threads
+ *      at once (see IndexNode).
+ *
+ * Nothing is visible until the end, when num_rows is bumped past the rows.
+ * If any row is bad, or its id is already taken, the whole import is
+ * thrown away.
+ */
+#define IMPORT_MIN_CHUNK_SIZE (64 * 1024)
+
+typedef struct {
+  Table *table;
+  const char *start;
+  const char *end;
+  char delimiter;
+  uint32_t num_rows;
+  uint32_t first_row_num;
+  // what the rows are stamped with (see write_stamp)
+  uint64_t stamp;
+  // first line in the chunk that didn't parse, or NULL
+  const char *bad_line;
+  PrepareResult bad_line_result;
+  // where the rows go instead of the table, for a partitioned import (see
+  // import_partitioned_rows); indexed by row_num. NULL for the table
+  Row *rows;
+  // how many of the chunk's rows are in the index, and whether it stopped
+  // short of the rest because an id was taken
+  uint32_t num_indexed;
+  bool is_duplicate;
+} ImportChunk;
+
+// hands out the next non-empty line and moves `position` past it
+bool next_line(const char **position, const char *end, const char **line,
+               size_t *length) {
+  while (*position < end) {
+    const char *line_start = *position;
+    const char *newline = memchr(line_start, '\n', end - line_start);
+    const char *line_end = newline != NULL ? newline : end;
+    *position = newline != NULL ? newline + 1 : end;
+
+    if (line_end > line_start && line_end[-1] == '\r') {
+      line_end--;
+    }
+    if (line_end > line_start) {
+      *line = line_start;
+      *length = line_end - line_start;
+      return true;
+    }
+  }
+  return false;
+}
+
+void *count_import_rows(void *argument) {
+  ImportChunk *chunk = argument;
+  const char *position = chunk->start;
+  const char *line;
+  size_t length;
+
+  chunk->num_rows = 0;
+  while (next_line(&position, chunk->end, &line, &length)) {
+    chunk->num_rows += 1;
+  }
+  return NULL;
+}
+
+// splits one `id,username,email` line into a row, with insert's checks
+PrepareResult parse_import_row(const char *line, size_t length,
+                               char delimiter, Row *row) {
+  Token fields[3];
+  const char *field_start = line;
+  const char *end = line + length;
+
+  for (uint32_t i = 0; i < 3; i++) {
+    const char *field_end = memchr(field_start, delimiter, end - field_start);
+    if (i == 2) {
+      // there's no 4th column
+      if (field_end != NULL) {
+        return PREPARE_SYNTAX_ERROR;
+      }
+      field_end = end;
+    } else if (field_end == NULL) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+
+    fields[i].start = field_start;
+    fields[i].length = field_end - field_start;
+    fields[i].type = fields[i].length > 0 ? TOKEN_WORD : TOKEN_END;
+    field_start = field_end + 1;
+  }
+
+  PrepareResult result = parse_id(&fields[0], &(row->id));
+  if (result == PREPARE_SUCCESS) {
+    result = parse_string(&fields[1], row->username, COLUMN_USERNAME_SIZE);
+  }
+  if (result == PREPARE_SUCCESS) {
+    result = parse_string(&fields[2], row->email, COLUMN_EMAIL_SIZE);
+  }
+  return result;
+}
+
+void *write_import_rows(void *argument) {
+  ImportChunk *chunk = argument;
+  const char *position = chunk->start;
+  const char *line;
+  size_t length;
+  uint32_t row_num = chunk->first_row_num;
+  Row row;
+
+  while (next_line(&position, chunk->end, &line, &length)) {
+    PrepareResult result =
+        parse_import_row(line, length, chunk->delimiter, &row);
+    if (result != PREPARE_SUCCESS) {
+      chunk->bad_line = line;
+      chunk->bad_line_result = result;
+      return NULL;
+    }
+    if (chunk->rows != NULL) {
+      chunk->rows[row_num] = row;
+    } else {
+      // the page was allocated before the workers started, so this is just
+      // arithmetic
+      serialize_row(&row, get_row_location(chunk->table, row_num));
+      set_version_stamps(chunk->table, row_num, chunk->stamp, 0);
+    }
+    row_num += 1;
+  }
+  return NULL;
+}
+
+// cuts the file into one chunk per worker thread, each ending on a newline
+uint32_t split_import_chunks(const char *data, size_t length,
+                             ImportChunk *chunks) {
+  uint32_t num_chunks =
+      worker_thread_count(length / IMPORT_MIN_CHUNK_SIZE + 1);
+
+  const char *end = data + length;
+  const char *chunk_start = data;
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < num_chunks && chunk_start < end; i++) {
+    const char *chunk_end = end;
+    if (i + 1 < num_chunks) {
+      const char *guess = data + length / num_chunks * (i + 1);
+      if (guess < chunk_start) {
+        guess = chunk_start;
+      }
+      const char *newline = memchr(guess, '\n', end - guess);
+      chunk_end = newline != NULL ? newline + 1 : end;
+    }
+
+    chunks[count].start = chunk_start;
+    chunks[count].end = chunk_end;
+    chunks[count].bad_line = NULL;
+    chunks[count].rows = NULL;
+    count += 1;
+    chunk_start = chunk_end;
+  }
+  return count;
+}
+
+// frees the pages an import allocated, after it failed
+void release_import_pages(Table *table, bool *is_new_page) {
+  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+    if (is_new_page[i]) {
+      retire_page(table, i);
+    }
+  }
+}
+
+// adds the chunk's rows to the index, stopping at the first id that's
+// already there
+void *index_import_rows(void *argument) {
+  ImportChunk *chunk = argument;
+  Table *table = chunk->table;
+  uint32_t existing_row_num;
+  chunk->is_duplicate = false;
+  for (chunk->num_indexed = 0; chunk->num_indexed < chunk->num_rows;
+       chunk->num_indexed++) {
+    uint32_t row_num = chunk->first_row_num + chunk->num_indexed;
+    if (!index_insert(&table->index, get_row_id(table, row_num), row_num,
+                      &existing_row_num)) {
+      chunk->is_duplicate = true;
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+// takes back out what index_import_rows put in, when some chunk's ids
+// weren't all free. Every id it added is this import's, even one another
+// chunk tripped over
+void *unindex_import_rows(void *argument) {
+  ImportChunk *chunk = argument;
+  for (uint32_t i = 0; i < chunk->num_indexed; i++) {
+    index_remove(&chunk->table->index,
+                 get_row_id(chunk->table, chunk->first_row_num + i));
+  }
+  return NULL;
+}
+
+// IMPORT_SUCCESS if every line parsed, or else what was wrong with the
+// first one that didn't, with its line number in `bad_line_number`
+ImportResult check_import_chunks(const char *data, ImportChunk *chunks,
+                                 uint32_t num_chunks,
+                                 uint32_t *bad_line_number) {
+  for (uint32_t i = 0; i < num_chunks; i++) {
+    if (chunks[i].bad_line != NULL) {
+      // line numbers are only worked out when something went wrong
+      *bad_line_number = 1;
+      for (const char *c = data; c < chunks[i].bad_line; c++) {
+        *bad_line_number += *c == '\n';
+      }
+      return chunks[i].bad_line_result == PREPARE_STRING_TOO_LONG
+                 ? IMPORT_STRING_TOO_LONG
+                 : IMPORT_BAD_ROW;
+    }
+  }
+  return IMPORT_SUCCESS;
+}
+
+ImportResult import_rows(Table *table, const char *data, size_t length,
+                         char delimiter, uint32_t *num_rows_imported,
+                         uint32_t *bad_line_number) {
+  ImportChunk chunks[MAX_WORKER_THREADS];
+  uint32_t num_chunks = split_import_chunks(data, length, chunks);
+
+  // pass 1: where does every chunk start
+  run_on_worker_threads(chunks, sizeof(ImportChunk), num_chunks,
+                        count_import_rows);
+  uint32_t first_row_num = table->num_rows;
+  uint32_t total_rows = 0;
+  for (uint32_t i = 0; i < num_chunks; i++) {
+    chunks[i].table = table;
+    chunks[i].delimiter = delimiter;
+    chunks[i].first_row_num = first_row_num + total_rows;
+    chunks[i].stamp = write_stamp(table);
+    total_rows += chunks[i].num_rows;
+  }
+  if (total_rows == 0) {
+    *num_rows_imported = 0;
+    return IMPORT_SUCCESS;
+  }
+  if (total_rows > TABLE_MAX_ROWS - first_row_num) {
+    return IMPORT_TABLE_FULL;
+  }
+
+  bool is_new_page[TABLE_MAX_PAGES] = {false};
+  uint32_t last_row_num = first_row_num + total_rows - 1;
+  for (uint32_t page_num = first_row_num / ROWS_PER_PAGE;
+       page_num <= last_row_num / ROWS_PER_PAGE; page_num++) {
+    if (table->pages[page_num] == NULL) {
+      get_page(table, page_num);
+      is_new_page[page_num] = true;
+    }
+  }
+
+  // pass 2: parse and write every row into its slot
+  run_on_worker_threads(chunks, sizeof(ImportChunk), num_chunks,
+                        write_import_rows);
+  ImportResult result =
+      check_import_chunks(data, chunks, num_chunks, bad_line_number);
+  if (result != IMPORT_SUCCESS) {
+    release_import_pages(table, is_new_page);
+    return result;
+  }
+
+  // pass 3: index every row
+  run_on_worker_threads(chunks, sizeof(ImportChunk), num_chunks,
+                        index_import_rows);
+  for (uint32_t i = 0; i < num_chunks; i++) {
+    if (chunks[i].is_duplicate) {
+      run_on_worker_threads(chunks, sizeof(ImportChunk), num_chunks,
+                            unindex_import_rows);
+      release_import_pages(table, is_new_page);
+      return IMPORT_DUPLICATE_KEY;
+    }
+  }
+
+  // new pages belong to the open transaction, if there is one, so a
+  // rollback frees them again
+  Transaction *transaction = &table->transaction;
+  if (transaction->is_open) {
+    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+      if (is_new_page[i] && transaction->undo_pages[i] == NULL) {
+        transaction->is_new_page[i] = true;
+      }
+    }
+  }
+
+  set_num_rows(table, table->num_rows + total_rows);
+  table->has_uncommitted_writes = true;
+  autocommit(table, EXECUTE_SUCCESS);
+  *num_rows_imported = total_rows;
+  return IMPORT_SUCCESS;
+}
+
+/*
+ * Export (.export file.csv) writes every live row as an `id,username,email`
+ * line, the same format .import reads.
+ *
+ * The pages are split into one range per worker thread. Each worker walks
+ * its range with a cursor and formats its rows into a buffer of its own
+ * (by hand; no printf per row), then the buffers are written out in order
+ * with one pwritev.
+ *
+ * A binary export skips formatting altogether: a small header followed by
+ * the pages themselves, written straight from the table's memory.
+ */
+typedef struct {
+  Table *table;
+  uint32_t start_row_num;
+  uint32_t end_row_num;
+  char *buffer;
+  size_t length;
+  size_t capacity;
+  uint32_t num_rows;
+} ExportChunk;
+
+// the most bytes one row can format to: id, two commas, both columns and
+// the newline
+#define EXPORT_MAX_LINE_SIZE                                                   \
+  (10 + 2 + COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE + 1)
+
+// writes `value` in decimal at `out` and returns how many bytes it took
+size_t format_uint(uint32_t value, char *out) {
+  char digits[10];
+  size_t num_digits = 0;
+  do {
+    digits[num_digits++] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+
+  for (size_t i = 0; i < num_digits; i++) {
+    out[i] = digits[num_digits - 1 - i];
+  }
+  return num_digits;
+}
+
+// copies a null-terminated column and returns its length
+size_t format_column(const char *column, size_t max_length, char *out) {
+  size_t length = strnlen(column, max_length);
+  memcpy(out, column, length);
+  return length;
+}
+
+void *format_export_rows(void *argument) {
+  ExportChunk *chunk = argument;
+  Cursor cursor;
+  cursor.table = chunk->table;
+  cursor.row_num = chunk->start_row_num;
+  cursor.snapshot = LATEST_SNAPSHOT;
+  cursor.end_row_num = chunk->end_row_num;
+  cursor_skip_deleted(&cursor);
+
+  while (!cursor_end_of_table(&cursor)) {
+    if (chunk->capacity - chunk->length < EXPORT_MAX_LINE_SIZE) {
+      chunk->capacity = chunk->capacity * 2 + EXPORT_MAX_LINE_SIZE;
+      chunk->buffer = realloc(chunk->buffer, chunk->capacity);
+    }
+
+    void *row = cursor_value(&cursor);
+    uint32_t id;
+    memcpy(&id, row + ID_OFFSET, ID_SIZE);
+
+    char *out = chunk->buffer + chunk->length;
+    size_t length = format_uint(id, out);
+    out[length++] = ',';
+    length += format_column(row + USERNAME_OFFSET, COLUMN_USERNAME_SIZE,
+                            out + length);
+    out[length++] = ',';
+    length +=
+        format_column(row + EMAIL_OFFSET, COLUMN_EMAIL_SIZE, out + length);
+    out[length++] = '\n';
+
+    chunk->length += length;
+    chunk->num_rows += 1;
+    cursor_advance(&cursor);
+  }
+  return NULL;
+}
+
+// pwritev until everything's written; it can stop partway like write()
+bool write_all(int fd, struct iovec *iov, int iovcnt) {
+  off_t offset = 0;
+  while (iovcnt > 0) {
+    ssize_t written = pwritev(fd, iov, iovcnt, offset);
+    if (written < 0) {
+      return false;
+    }
+    offset += written;
+
+    while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return true;
+}
+
+ExportResult export_csv(Table *table, int fd, uint32_t *num_rows_exported) {
+  uint32_t num_pages = (table->num_rows + ROWS_PER_PAGE - 1) / ROWS_PER_PAGE;
+  uint32_t num_chunks = worker_thread_count(num_pages);
+  uint32_t pages_per_chunk = (num_pages + num_chunks - 1) / num_chunks;
+
+  ExportChunk chunks[MAX_WORKER_THREADS];
+  for (uint32_t i = 0; i < num_chunks; i++) {
+    uint32_t start = i * pages_per_chunk * ROWS_PER_PAGE;
+    uint32_t end = start + pages_per_chunk * ROWS_PER_PAGE;
+    chunks[i].table = table;
+    chunks[i].start_row_num = start < table->num_rows ? start : table->num_rows;
+    chunks[i].end_row_num = end < table->num_rows ? end : table->num_rows;
+    chunks[i].buffer = NULL;
+    chunks[i].length = 0;
+    chunks[i].capacity = 0;
+    chunks[i].num_rows = 0;
+  }
+  run_on_worker_threads(chunks, sizeof(ExportChunk), num_chunks,
+                        format_export_rows);
+
+  struct iovec iov[MAX_WORKER_THREADS];
+  *num_rows_exported = 0;
+  for (uint32_t i = 0; i < num_chunks; i++) {
+    iov[i].iov_base = chunks[i].buffer;
+    iov[i].iov_len = chunks[i].length;
+    *num_rows_exported += chunks[i].num_rows;
+  }
+  bool is_written = write_all(fd, iov, num_chunks);
+
+  for (uint32_t i = 0; i < num_chunks; i++) {
+    free(chunks[i].buffer);
+  }
+  return is_written ? EXPORT_SUCCESS : EXPORT_WRITE_FAILED;
+}
+
+/*
+ * Binary export layout:
+ *
+ *   "TAEPAGES" | num_rows (u32) | page size (u32) | page 0 | page 1 | ...
+ *
+ * Each page is copied exactly as it sits in memory, tombstone bitmap
+ * included. There's nothing to format, so it's a single pwritev straight
+ * from the pages; no worker threads needed.
+ */
+typedef struct {
+  char magic[8];
+  uint32_t num_rows;
+  uint32_t page_size;
+} ExportHeader;
+
+void fill_export_header(Table *table, ExportHeader *header) {
+  memcpy(header->magic, "TAEPAGES", 8);
+  header->num_rows = table->num_rows;
+  header->page_size = PAGE_SIZE;
+}
+
+// the rows a binary export holds that are still live
+uint32_t count_exported_rows(Table *table) {
+  return table->num_rows - count_deleted_rows(table) -
+         table->num_dead_versions;
+}
+
+ExportResult export_binary(Table *table, int fd, uint32_t *num_rows_exported) {
+  uint32_t num_pages = (table->num_rows + ROWS_PER_PAGE - 1) / ROWS_PER_PAGE;
+
+  ExportHeader header;
+  fill_export_header(table, &header);
+
+  struct iovec iov[TABLE_MAX_PAGES + 1];
+  iov[0].iov_base = &header;
+  iov[0].iov_len = sizeof(header);
+  for (uint32_t i = 0; i < num_pages; i++) {
+    iov[i + 1].iov_base = table->pages[i];
+    iov[i + 1].iov_len = PAGE_SIZE;
+  }
+  if (!write_all(fd, iov, num_pages + 1)) {
+    return EXPORT_WRITE_FAILED;
+  }
+
+  *num_rows_exported = count_exported_rows(table);
+  return EXPORT_SUCCESS;
+}
+
+// export_binary into the chunk's buffer instead of a file, for a partition
+// whose lock is let go before anything's written
+void copy_binary_export(Table *table, ExportChunk *chunk) {
+  uint32_t num_pages = (table->num_rows + ROWS_PER_PAGE - 1) / ROWS_PER_PAGE;
+  chunk->length = sizeof(ExportHeader) + (size_t)num_pages * PAGE_SIZE;
+  chunk->capacity = chunk->length;
+  chunk->buffer = malloc(chunk->length);
+
+  ExportHeader header;
+  fill_export_header(table, &header);
+  memcpy(chunk->buffer, &header, sizeof(header));
+  for (uint32_t i = 0; i < num_pages; i++) {
+    memcpy(chunk->buffer + sizeof(header) + (size_t)i * PAGE_SIZE,
+           table->pages[i], PAGE_SIZE);
+  }
+  chunk->num_rows = count_exported_rows(table);
+}
+
+DB *db_open() {
+  DB *db = malloc(sizeof(DB));
+  db->table = new_table();
+  db->num_interrupts = 0;
+  db->timeout_ms = 0;
+  db->is_reader = false;
+  db->reader_slot = 0;
+  db->append_buffer = NULL;
+  db->partitions = NULL;
+  db->num_partitions = 0;
+  db->is_transaction_open = 0;
+  return db;
+}
+
+void db_close(DB *db) {
+  if (db->append_buffer != NULL) {
+    // whatever's left in the buffer goes in before the handle goes away
+    enter_append(db->table);
+    flush_append_buffer(db->table, db->append_buffer);
+    __atomic_store_n(&db->table->reader_slots[db->reader_slot].append_buffer,
+                     NULL, __ATOMIC_RELEASE);
+    exit_append(db->table);
+    free(db->append_buffer);
+  }
+  if (db->partitions != NULL) {
+    for (uint32_t i = 0; i < db->num_partitions; i++) {
+      db_close(db->partitions[i].db);
+      pthread_mutex_destroy(&db->partitions[i].lock);
+    }
+    free(db->partitions);
+  } else if (db->is_reader) {
+    __atomic_sub_fetch(&db->table->num_reader_handles, 1, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&db->table->reader_slots[db->reader_slot].is_taken, 0,
+                     __ATOMIC_RELEASE);
+  } else {
+    free_table(db->table);
+  }
+  free(db);
+}
+
+DB *db_open_reader(DB *db) {
+  if (db->partitions != NULL) {
+    // every thread can use the partitioned handle itself
+    return NULL;
+  }
+  Table *table = db->table;
+  for (uint32_t i = 0; i < MAX_READERS; i++) {
+    uint32_t is_taken = 0;
+    if (__atomic_compare_exchange_n(&table->reader_slots[i].is_taken,
+                                    &is_taken, 1, false, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_RELAXED)) {
+      DB *reader = malloc(sizeof(DB));
+      reader->table = table;
+      reader->num_interrupts = 0;
+      reader->timeout_ms = db->timeout_ms;
+      reader->is_reader = true;
+      reader->reader_slot = i;
+      reader->append_buffer = NULL;
+      reader->partitions = NULL;
+      reader->num_partitions = 0;
+      reader->is_transaction_open = 0;
+      __atomic_add_fetch(&table->num_reader_handles, 1, __ATOMIC_ACQ_REL);
+      return reader;
+    }
+  }
+  return NULL;
+}
+
+DB *db_open_appender(DB *db) {
+  DB *appender = db_open_reader(db);
+  if (appender != NULL) {
+    AppendBuffer *buffer = malloc(sizeof(AppendBuffer));
+    buffer->num_rows = 0;
+    appender->append_buffer = buffer;
+    __atomic_store_n(
+        &db->table->reader_slots[appender->reader_slot].append_buffer, buffer,
+        __ATOMIC_RELEASE);
+  }
+  return appender;
+}
+
+void db_flush(DB *db) {
+  if (db->append_buffer != NULL) {
+    enter_append(db->table);
+    flush_append_buffer(db->table, db->append_buffer);
+    exit_append(db->table);
+  }
+}
+
+DB *db_open_partitioned(uint32_t num_partitions) {
+  if (num_partitions == 0 || num_partitions > MAX_PARTITIONS) {
+    return NULL;
+  }
+  DB *db = malloc(sizeof(DB));
+  db->table = NULL;
+  db->num_interrupts = 0;
+  db->timeout_ms = 0;
+  db->is_reader = false;
+  db->reader_slot = 0;
+  db->append_buffer = NULL;
+  db->partitions = malloc(num_partitions * sizeof(Partition));
+  db->num_partitions = num_partitions;
+  db->is_transaction_open = 0;
+  for (uint32_t i = 0; i < num_partitions; i++) {
+    db->partitions[i].db = db_open();
+    pthread_mutex_init(&db->partitions[i].lock, NULL);
+  }
+  return db;
+}
+
+PrepareResult db_prepare(DB *db, const char *sql, size_t sql_length,
+                         Statement *statement) {
+  statement->db = db;
+  // the scan gets its snapshot, and moves to its first row, on its first
+  // step (see take_snapshot)
+  statement->cursor.table = db->table;
+  statement->cursor.row_num = 0;
+  statement->cursor.snapshot = 0;
+  statement->cursor.end_row_num = 0;
+  statement->snapshot_slot = NO_SNAPSHOT_SLOT;
+  statement->partition_scans = NULL;
+  statement->partition_num = 0;
+  statement->current_row = NULL;
+  statement->is_done = false;
+  statement->is_scan_open = false;
+  statement->num_interrupts_at_prepare =
+      __atomic_load_n(&db->num_interrupts, __ATOMIC_RELAXED);
+  statement->is_cancelled = false;
+  statement->timeout_ms = db->timeout_ms;
+  statement->deadline = 0;
+  // checked on the very first step, so a statement interrupted before it
+  // starts never hands out a row
+  statement->next_check_row = 0;
+
+  Parser parser;
+  parser.next = sql;
+  parser.end = sql + sql_length;
+  parser.block_start = NULL;
+  return parse_statement(&parser, statement);
+}
+
+/*
+ * Registers the scan's snapshot before it's used: a provisional one goes
+ * in a slot first and the real one, read after, can only be newer. Any
+ * collect_garbage that missed the slot read the commit stamp before we did
+ * (see oldest_snapshot), so it can't free anything we'd see.
+ *
+ * On the writer's handle inside a transaction the snapshot also takes in
+ * the transaction's own writes.
+ *
+ * Appends are stamped with the last commit, which may well be the
+ * snapshot itself, so the scan also stops at num_rows as of now. That's
+ * read after the stamp, so a version the writer ended before the snapshot
+ * has its replacement below it.
+ */
+void take_snapshot(Statement *statement) {
+  DB *db = statement->db;
+  Table *table = db->table;
+  uint64_t provisional =
+      __atomic_load_n(&table->commit_stamp, __ATOMIC_SEQ_CST);
+  for (uint32_t i = 0; i < MAX_SNAPSHOT_SLOTS; i++) {
+    uint64_t free_slot = 0;
+    if (__atomic_compare_exchange_n(&table->snapshots[i], &free_slot,
+                                    provisional, false, __ATOMIC_SEQ_CST,
+                                    __ATOMIC_RELAXED)) {
+      statement->snapshot_slot = i;
+      break;
+    }
+  }
+  if (statement->snapshot_slot == NO_SNAPSHOT_SLOT) {
+    __atomic_add_fetch(&table->num_unslotted_scans, 1, __ATOMIC_SEQ_CST);
+  }
+
+  uint64_t snapshot = __atomic_load_n(&table->commit_stamp, __ATOMIC_SEQ_CST);
+  if (!db->is_reader && table->transaction.is_open) {
+    snapshot = write_stamp(table);
+  }
+  uint32_t end_row_num = get_num_rows(table);
+  if (statement->snapshot_slot != NO_SNAPSHOT_SLOT) {
+    // so truncate_deleted_tail leaves the rows up to here alone
+    __atomic_store_n(&table->snapshot_end_rows[statement->snapshot_slot],
+                     end_row_num, __ATOMIC_RELEASE);
+  }
+  if (db->is_reader) {
+    // a reader skips what it can't see as it goes (see read_next_row)
+    statement->cursor.snapshot = snapshot;
+    statement->cursor.end_row_num = end_row_num;
+  } else {
+    statement->cursor = table_start(table, snapshot, end_row_num);
+  }
+}
+
+void release_snapshot(Statement *statement) {
+  Table *table = statement->db->table;
+  if (statement->snapshot_slot == NO_SNAPSHOT_SLOT) {
+    __atomic_sub_fetch(&table->num_unslotted_scans, 1, __ATOMIC_SEQ_CST);
+  } else {
+    __atomic_store_n(&table->snapshots[statement->snapshot_slot], 0,
+                     __ATOMIC_RELEASE);
+  }
+}
+
+/*
+ * A select's scan is open from its first step until it runs out of rows or
+ * is finalized. Between steps the caller may well run other statements (the
+ * server interleaves clients' statements); the scan's snapshot keeps what
+ * they do out of its sight, and open scans keep autovacuum from moving
+ * rows around underneath them.
+ */
+void open_scan(Statement *statement) {
+  if (!statement->is_scan_open) {
+    Table *table = statement->db->table;
+    statement->is_scan_open = true;
+    __atomic_add_fetch(&table->num_open_scans, 1, __ATOMIC_SEQ_CST);
+    // a reader waits out a write the writer started before it could see
+    // this scan (see can_overwrite_versions); that's one statement at most
+    if (statement->db->is_reader) {
+      while (__atomic_load_n(&table->is_overwriting, __ATOMIC_SEQ_CST)) {
+        sched_yield();
+      }
+    }
+    // an appender's selects see its own inserts
+    db_flush(statement->db);
+    take_snapshot(statement);
+    if (statement->timeout_ms > 0) {
+      statement->deadline =
+          monotonic_ns() + (uint64_t)statement->timeout_ms * 1000000;
+    }
+  }
+}
+
+void close_scan(Statement *statement) {
+  if (statement->is_scan_open) {
+    statement->is_scan_open = false;
+    release_snapshot(statement);
+    __atomic_sub_fetch(&statement->db->table->num_open_scans, 1,
+                       __ATOMIC_ACQ_REL);
+  }
+  statement->is_done = true;
+}
+
+// which partition the row with `id` goes in. The id is hashed first so
+// that runs of ids spread over every partition
+uint32_t partition_of(DB *db, uint32_t id) {
+  uint32_t hash = id * 2654435761u;
+  return ((uint64_t)hash * db->num_partitions) >> 32;
+}
+
+// true on the thread whose transaction holds every partition's lock
+bool owns_partitions(DB *db) {
+  return __atomic_load_n(&db->is_transaction_open, __ATOMIC_ACQUIRE) &&
+         pthread_equal(__atomic_load_n(&db->transaction_thread,
+                                       __ATOMIC_RELAXED),
+                       pthread_self());
+}
+
+void lock_partition(DB *db, uint32_t partition_num) {
+  if (!owns_partitions(db)) {
+    pthread_mutex_lock(&db->partitions[partition_num].lock);
+  }
+}
+
+void unlock_partition(DB *db, uint32_t partition_num) {
+  if (!owns_partitions(db)) {
+    pthread_mutex_unlock(&db->partitions[partition_num].lock);
+  }
+}
+
+void lock_partitions(DB *db) {
+  for (uint32_t i = 0; i < db->num_partitions; i++) {
+    lock_partition(db, i);
+  }
+}
+
+void unlock_partitions(DB *db) {
+  for (uint32_t i = 0; i < db->num_partitions; i++) {
+    unlock_partition(db, i);
+  }
+}
+
+// runs the statement on a partition's own handle, as if it had been
+// prepared there, with the partition's lock held
+ExecuteResult step_on_partition(Statement *statement, DB *partition) {
+  Statement copy = *statement;
+  copy.db = partition;
+  copy.cursor.table = partition->table;
+  copy.is_done = false;
+  return db_step(&copy);
+}
+
+ExecuteResult begin_partitioned(Statement *statement) {
+  DB *db = statement->db;
+  if (owns_partitions(db)) {
+    return EXECUTE_TRANSACTION_ALREADY_OPEN;
+  }
+  // waits for any other thread's transaction to end
+  lock_partitions(db);
+  for (uint32_t i = 0; i < db->num_partitions; i++) {
+    step_on_partition(statement, db->partitions[i].db);
+  }
+  __atomic_store_n(&db->transaction_thread, pthread_self(), __ATOMIC_RELAXED);
+  __atomic_store_n(&db->is_transaction_open, 1, __ATOMIC_RELEASE);
+  return EXECUTE_SUCCESS;
+}
+
+// COMMIT or ROLLBACK, on every partition
+ExecuteResult end_partitioned(Statement *statement) {
+  DB *db = statement->db;
+  if (!owns_partitions(db)) {
+    return EXECUTE_NO_TRANSACTION;
+  }
+  for (uint32_t i = 0; i < db->num_partitions; i++) {
+    step_on_partition(statement, db->partitions[i].db);
+  }
+  __atomic_store_n(&db->is_transaction_open, 0, __ATOMIC_RELEASE);
+  for (uint32_t i = 0; i < db->num_partitions; i++) {
+    pthread_mutex_unlock(&db->partitions[i].lock);
+  }
+  return EXECUTE_SUCCESS;
+}
+
+/*
+ * Vacuum, import, export and selects on a partitioned handle spread the
+ * partitions over worker threads: each one takes every num_workers-th
+ * partition from first_partition on.
+ */
+typedef struct {
+  DB *db;
+  uint32_t first_partition;
+  uint32_t num_workers;
+  // set when the calling thread's transaction already holds every lock, so
+  // the worker doesn't wait on it
+  bool is_owner;
+  // import: every row in the file, and how far this worker got through
+  // them before one didn't go in
+  Row *rows;
+  uint32_t num_rows;
+  uint32_t end_row;
+  ImportResult result;
+  // select: every partition's scan
+  struct PartitionScan *scans;
+  // export: every partition's buffer
+  ExportChunk *chunks;
+  bool is_binary;
+} PartitionWorker;
+
+// sets up one worker per thread for `db`'s partitions and returns how many
+uint32_t split_partition_workers(DB *db, PartitionWorker *workers) {
+  uint32_t num_workers = worker_thread_count(db->num_partitions);
+  bool is_owner = owns_partitions(db);
+  for (uint32_t i = 0; i < num_workers; i++) {
+    workers[i].db = db;
+    workers[i].first_partition = i;
+    workers[i].num_workers = num_workers;
+    workers[i].is_owner = is_owner;
+    workers[i].rows = NULL;
+    workers[i].num_rows = 0;
+    workers[i].end_row = 0;
+    workers[i].result = IMPORT_SUCCESS;
+    workers[i].scans = NULL;
+    workers[i].chunks = NULL;
+    workers[i].is_binary = false;
+  }
+  return num_workers;
+}
+
+// lock_partition from a worker thread, which never owns the transaction
+// itself
+void lock_worker_partition(PartitionWorker *worker, uint32_t partition_num) {
+  if (!worker->is_owner) {
+    pthread_mutex_lock(&worker->db->partitions[partition_num].lock);
+  }
+}
+
+void unlock_worker_partition(PartitionWorker *worker,
+                             uint32_t partition_num) {
+  if (!worker->is_owner) {
+    pthread_mutex_unlock(&worker->db->partitions[partition_num].lock);
+  }
+}
+
+/*
+ * A select on a partitioned handle is a select of its own on each
+ * partition's handle. Their rows are read in rounds of up to
+ * PARTITION_SCAN_ROWS, every partition at once on the worker threads, and
+ * copied out so the partitions' locks can be let go; db_step then hands
+ * them out one partition's rows after another.
+ *
+ * A round is several batches long because starting the worker threads
+ * costs more than reading one batch: a round per batch made the select
+ * slower than reading the partitions one after another.
+ */
+#define PARTITION_SCAN_ROWS (8 * ROW_BATCH_SIZE)
+
+typedef struct PartitionScan {
+  Statement statement;
+  // where each of the round's batches is read to before it's copied out
+  RowBatch batch;
+  // the rows this round read, and the next one to hand out
+  Row *rows;
+  uint32_t num_rows;
+  uint32_t next_row;
+  // what the last batch ended with: EXECUTE_ROW while the partition may
+  // have more rows
+  ExecuteResult result;
+} PartitionScan;
+
+/*
+ * Opens a scan on every partition with all their locks held, so the select
+ * sees the whole table as of one moment.
+ */
+void open_partitioned_scan(Statement *statement) {
+  DB *db = statement->db;
+  statement->is_scan_open = true;
+  if (statement->timeout_ms > 0) {
+    statement->deadline =
+        monotonic_ns() + (uint64_t)statement->timeout_ms * 1000000;
+  }
+
+  statement->partition_scans =
+      malloc(db->num_partitions * sizeof(PartitionScan));
+  // nothing's been read yet, so the first step starts by reading
+  statement->partition_num = db->num_partitions;
+  for (uint32_t i = 0; i < db->num_partitions; i++) {
+    PartitionScan *scan = &statement->partition_scans[i];
+    DB *partition = db->partitions[i].db;
+    scan->statement = *statement;
+    scan->statement.db = partition;
+    scan->statement.cursor.table = partition->table;
+    scan->statement.partition_scans = NULL;
+    // interrupts and cancels go to this statement; the deadline is the
+    // same for all of them
+    scan->statement.num_interrupts_at_prepare = partition->num_interrupts;
+    scan->statement.is_cancelled = false;
+    scan->statement.timeout_ms = 0;
+    scan->statement.is_scan_open = false;
+    scan->batch.num_rows = 0;
+    scan->rows = malloc(PARTITION_SCAN_ROWS * sizeof(Row));
+    scan->num_rows = 0;
+    scan->next_row = 0;
+    scan->result = EXECUTE_ROW;
+  }
+
+  lock_partitions(db);
+  for (uint32_t i = 0; i < db->num_partitions; i++) {
+    open_scan(&statement->partition_scans[i].statement);
+  }
+  unlock_partitions(db);
+}
+
+void close_partitioned_scan(Statement *statement) {
+  DB *db = statement->db;
+  if (statement->partition_scans != NULL) {
+    for (uint32_t i = 0; i < db->num_partitions; i++) {
+      Statement *scan = &statement->partition_scans[i].statement;
+      if (scan->is_scan_open) {
+        lock_partition(db, i);
+        close_scan(scan);
+        unlock_partition(db, i);
+      }
+      free(statement->partition_scans[i].rows);
+    }
+    free(statement->partition_scans);
+    statement->partition_scans = NULL;
+  }
+  statement->is_scan_open = false;
+  statement->is_done = true;
+}
+
+// reads the next round of each of the worker's partitions that has more,
+// under one lock per round. The rows are copied, since another thread can
+// write to the partition as soon as it's let go
+void *fill_partition_range(void *argument) {
+  PartitionWorker *worker = argument;
+  DB *db = worker->db;
+  for (uint32_t i = worker->first_partition; i < db->num_partitions;
+       i += worker->num_workers) {
+    PartitionScan *scan = &worker->scans[i];
+    if (scan->result != EXECUTE_ROW) {
+      continue;
+    }
+    RowBatch *batch = &scan->batch;
+    scan->num_rows = 0;
+    scan->next_row = 0;
+    lock_worker_partition(worker, i);
+    while (scan->result == EXECUTE_ROW &&
+           scan->num_rows + ROW_BATCH_SIZE <= PARTITION_SCAN_ROWS) {
+      scan->result = db_step_batch(&scan->statement, batch);
+      for (uint32_t j = 0; j < batch->num_rows; j++) {
+        Row *copy = &scan->rows[scan->num_rows];
+        copy->id = batch->ids[j];
+        memcpy(copy->username, batch->usernames[j], USERNAME_SIZE);
+        memcpy(copy->email, batch->emails[j], EMAIL_SIZE);
+        scan->num_rows += 1;
+      }
+    }
+    unlock_worker_partition(worker, i);
+  }
+  return NULL;
+}
+
+// reads every partition's next round, if any of them has more. False once
+// they've all run out
+bool fill_partition_scans(Statement *statement) {
+  DB *db = statement->db;
+  bool has_more = false;
+  for (uint32_t i = 0; i < db->num_partitions; i++) {
+    has_more |= statement->partition_scans[i].result == EXECUTE_ROW;
+  }
+  if (!has_more) {
+    return false;
+  }
+
+  PartitionWorker workers[MAX_WORKER_THREADS];
+  uint32_t num_workers = split_partition_workers(db, workers);
+  for (uint32_t i = 0; i < num_workers; i++) {
+    workers[i].scans = statement->partition_scans;
+  }
+  run_on_worker_threads(workers, sizeof(PartitionWorker), num_workers,
+                        fill_partition_range);
+  return true;
+}
+
+/*
+ * Hands out the next row of a select on a partitioned handle: the next one
+ * the partition it's on read this round, or the next partition's, reading
+ * another round once they've all been handed out. A partition's
+ * scan that timed out or was interrupted stops the select after its last
+ * rows.
+ */
+ExecuteResult step_partitioned_select(Statement *statement) {
+  DB *db = statement->db;
+  if (statement->partition_scans == NULL) {
+    open_partitioned_scan(statement);
+  }
+
+  ExecuteResult result = EXECUTE_SUCCESS;
+  while (true) {
+    if (__atomic_load_n(&statement->is_cancelled, __ATOMIC_RELAXED) ||
+        __atomic_load_n(&db->num_interrupts, __ATOMIC_RELAXED) !=
+            statement->num_interrupts_at_prepare) {
+      result = EXECUTE_INTERRUPTED;
+      break;
+    }
+    if (statement->partition_num == db->num_partitions) {
+      if (!fill_partition_scans(statement)) {
+        break;
+      }
+      statement->partition_num = 0;
+    }
+
+    PartitionScan *scan = &statement->partition_scans[statement->partition_num];
+    if (scan->next_row < scan->num_rows) {
+      statement->current_row = &scan->rows[scan->next_row];
+      scan->next_row += 1;
+      return EXECUTE_ROW;
+    }
+    if (scan->result != EXECUTE_ROW && scan->result != EXECUTE_SUCCESS) {
+      result = scan->result;
+      break;
+    }
+    statement->partition_num += 1;
+  }
+  close_partitioned_scan(statement);
+  return result;
+}
+
+/*
+ * db_step on a partitioned handle. Everything but a select touches one id,
+ * and so one partition, and only locks that one; BEGIN, COMMIT and ROLLBACK
+ * go to all of them.
+ */
+ExecuteResult step_partitioned(Statement *statement) {
+  DB *db = statement->db;
+  if (statement->is_done) {
+    return EXECUTE_SUCCESS;
+  }
+
+  uint32_t id = statement->where_id;
+  switch (statement->type) {
+  case (STATEMENT_SELECT):
+    return step_partitioned_select(statement);
+  case (STATEMENT_BEGIN):
+    statement->is_done = true;
+    return begin_partitioned(statement);
+  case (STATEMENT_COMMIT):
+  case (STATEMENT_ROLLBACK):
+    statement->is_done = true;
+    return end_partitioned(statement);
+  case (STATEMENT_INSERT):
+    id = statement->row_to_insert.id;
+    break;
+  case (STATEMENT_UPDATE):
+  case (STATEMENT_DELETE):
+    break;
+  }
+
+  statement->is_done = true;
+  uint32_t partition_num = partition_of(db, id);
+  lock_partition(db, partition_num);
+  ExecuteResult result =
+      step_on_partition(statement, db->partitions[partition_num].db);
+  unlock_partition(db, partition_num);
+  return result;
+}
+
+void *vacuum_partition_range(void *argument) {
+  PartitionWorker *worker = argument;
+  DB *db = worker->db;
+  for (uint32_t i = worker->first_partition; i < db->num_partitions;
+       i += worker->num_workers) {
+    pthread_mutex_lock(&db->partitions[i].lock);
+    db_vacuum(db->partitions[i].db);
+    pthread_mutex_unlock(&db->partitions[i].lock);
+  }
+  return NULL;
+}
+
+bool vacuum_partitions(DB *db) {
+  if (owns_partitions(db)) {
+    return false;
+  }
+  PartitionWorker workers[MAX_WORKER_THREADS];
+  uint32_t num_workers = split_partition_workers(db, workers);
+  run_on_worker_threads(workers, sizeof(PartitionWorker), num_workers,
+                        vacuum_partition_range);
+  return true;
+}
+
+// the worker's partitions' share of the rows, in file order, until one of
+// them doesn't go in
+void *insert_partition_rows(void *argument) {
+  PartitionWorker *worker = argument;
+  DB *db = worker->db;
+  Statement insert;
+  insert.is_upsert = false;
+  for (uint32_t i = 0; i < worker->num_rows; i++) {
+    uint32_t partition_num = partition_of(db, worker->rows[i].id);
+    if (partition_num % worker->num_workers != worker->first_partition) {
+      continue;
+    }
+    insert.row_to_insert = worker->rows[i];
+    ExecuteResult result =
+        execute_insert(&insert, db->partitions[partition_num].db->table);
+    if (result != EXECUTE_SUCCESS) {
+      worker->result = result == EXECUTE_TABLE_FULL ? IMPORT_TABLE_FULL
+                                                    : IMPORT_DUPLICATE_KEY;
+      worker->end_row = i;
+      return NULL;
+    }
+  }
+  worker->end_row = worker->num_rows;
+  return NULL;
+}
+
+// takes back the rows insert_partition_rows put in, when another worker's
+// didn't all go in
+void *remove_partition_rows(void *argument) {
+  PartitionWorker *worker = argument;
+  DB *db = worker->db;
+  Statement deletion;
+  for (uint32_t i = 0; i < worker->end_row; i++) {
+    uint32_t partition_num = partition_of(db, worker->rows[i].id);
+    if (partition_num % worker->num_workers == worker->first_partition) {
+      deletion.where_id = worker->rows[i].id;
+      execute_delete(&deletion, db->partitions[partition_num].db->table);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * db_import on a partitioned handle. The file's parsed on worker threads
+ * as usual, just into an array rather than straight into the pages, since
+ * the rows are spread over the partitions. Then each worker inserts its
+ * partitions' rows.
+ *
+ * It's all or nothing, like any import: outside a transaction it's a
+ * transaction of its own, and inside one the rows that went in are
+ * deleted again if any didn't.
+ */
+ImportResult import_partitioned_rows(DB *db, const char *data, size_t length,
+                                     char delimiter,
+                                     uint32_t *num_rows_imported,
+                                     uint32_t *bad_line_number) {
+  ImportChunk chunks[MAX_WORKER_THREADS];
+  uint32_t num_chunks = split_import_chunks(data, length, chunks);
+  run_on_worker_threads(chunks, sizeof(ImportChunk), num_chunks,
+                        count_import_rows);
+  uint32_t total_rows = 0;
+  for (uint32_t i = 0; i < num_chunks; i++) {
+    total_rows += chunks[i].num_rows;
+  }
+  if (total_rows == 0) {
+    *num_rows_imported = 0;
+    return IMPORT_SUCCESS;
+  }
+  Row *rows = malloc(total_rows * sizeof(Row));
+  total_rows = 0;
+  for (uint32_t i = 0; i < num_chunks; i++) {
+    chunks[i].table = NULL;
+    chunks[i].delimiter = delimiter;
+    chunks[i].first_row_num = total_rows;
+    chunks[i].rows = rows;
+    total_rows += chunks[i].num_rows;
+  }
+  run_on_worker_threads(chunks, sizeof(ImportChunk), num_chunks,
+                        write_import_rows);
+  ImportResult result =
+      check_import_chunks(data, chunks, num_chunks, bad_line_number);
+  if (result != IMPORT_SUCCESS) {
+    free(rows);
+    return result;
+  }
+
+  PartitionWorker workers[MAX_WORKER_THREADS];
+  uint32_t num_workers = split_partition_workers(db, workers);
+  for (uint32_t i = 0; i < num_workers; i++) {
+    workers[i].rows = rows;
+    workers[i].num_rows = total_rows;
+  }
+  // the workers write on this thread's behalf, under its locks
+  bool is_own_transaction = !owns_partitions(db);
+  if (is_own_transaction) {
+    lock_partitions(db);
+    for (uint32_t i = 0; i < db->num_partitions; i++) {
+      execute_begin(db->partitions[i].db->table);
+    }
+  }
+  run_on_worker_threads(workers, sizeof(PartitionWorker), num_workers,
+                        insert_partition_rows);
+  for (uint32_t i = 0; i < num_workers && result == IMPORT_SUCCESS; i++) {
+    result = workers[i].result;
+  }
+
+  if (is_own_transaction) {
+    for (uint32_t i = 0; i < db->num_partitions; i++) {
+      Table *table = db->partitions[i].db->table;
+      if (result == IMPORT_SUCCESS) {
+        execute_commit(table);
+      } else {
+        execute_rollback(table);
+      }
+    }
+    unlock_partitions(db);
+  } else if (result != IMPORT_SUCCESS) {
+    run_on_worker_threads(workers, sizeof(PartitionWorker), num_workers,
+                          remove_partition_rows);
+  }
+  free(rows);
+  *num_rows_imported = result == IMPORT_SUCCESS ? total_rows : 0;
+  return result;
+}
+
+// formats each of the worker's partitions into its own buffer, the way a
+// whole table would be exported, holding only that partition's lock
+void *export_partition_range(void *argument) {
+  PartitionWorker *worker = argument;
+  DB *db = worker->db;
+  for (uint32_t i = worker->first_partition; i < db->num_partitions;
+       i += worker->num_workers) {
+    ExportChunk *chunk = &worker->chunks[i];
+    lock_worker_partition(worker, i);
+    Table *table = db->partitions[i].db->table;
+    if (worker->is_binary) {
+      copy_binary_export(table, chunk);
+    } else {
+      chunk->table = table;
+      chunk->start_row_num = 0;
+      chunk->end_row_num = table->num_rows;
+      format_export_rows(chunk);
+    }
+    unlock_worker_partition(worker, i);
+  }
+  return NULL;
+}
+
+/*
+ * db_export on a partitioned handle. The partitions are formatted on the
+ * worker threads, each as of when its worker got to it, and then written
+ * in partition order with one pwritev.
+ */
+ExportResult export_partitions(DB *db, int fd, bool is_binary,
+                               uint32_t *num_rows_exported) {
+  ExportChunk chunks[MAX_PARTITIONS];
+  for (uint32_t i = 0; i < db->num_partitions; i++) {
+    chunks[i].buffer = NULL;
+    chunks[i].length = 0;
+    chunks[i].capacity = 0;
+    chunks[i].num_rows = 0;
+  }
+  PartitionWorker workers[MAX_WORKER_THREADS];
+  uint32_t num_workers = split_partition_workers(db, workers);
+  for (uint32_t i = 0; i < num_workers; i++) {
+    workers[i].chunks = chunks;
+    workers[i].is_binary = is_binary;
+  }
+  run_on_worker_threads(workers, sizeof(PartitionWorker), num_workers,
+                        export_partition_range);
+
+  struct iovec iov[MAX_PARTITIONS];
+  *num_rows_exported = 0;
+  for (uint32_t i = 0; i < db->num_partitions; i++) {
+    iov[i].iov_base = chunks[i].buffer;
+    iov[i].iov_len = chunks[i].length;
+    *num_rows_exported += chunks[i].num_rows;
+  }
+  bool is_written = write_all(fd, iov, db->num_partitions);
+
+  for (uint32_t i = 0; i < db->num_partitions; i++) {
+    free(chunks[i].buffer);
+  }
+  return is_written ? EXPORT_SUCCESS : EXPORT_WRITE_FAILED;
+}
+
+ExecuteResult db_step(Statement *statement) {
+  if (statement->db->partitions != NULL) {
+    return step_partitioned(statement);
+  }
+  Table *table = statement->db->table;
+  if (statement->type == STATEMENT_SELECT) {
+    if (statement->is_done) {
+      return EXECUTE_SUCCESS;
+    }
+    open_scan(statement);
+    ExecuteResult result = check_interrupt(statement);
+    if (result == EXECUTE_ROW) {
+      result = statement->db->is_reader ? execute_select_copy(statement)
+                                        : execute_select(statement);
+    }
+    if (result != EXECUTE_ROW) {
+      close_scan(statement);
+    }
+    return result;
+  }
+
+  if (statement->is_done) {
+    return EXECUTE_SUCCESS;
+  }
+  statement->is_done = true;
+  if (statement->db->is_reader) {
+    if (statement->db->append_buffer != NULL &&
+        statement->type == STATEMENT_INSERT && !statement->is_upsert) {
+      return execute_append(statement);
+    }
+    return EXECUTE_READ_ONLY;
+  }
+  // the writer has the table to itself while it writes (see block_appends)
+  block_appends(table);
+  // a write is as good a time as any to free pages readers are done with,
+  // and versions that scans which have since finished were holding on to
+  if (table->num_retired_pages > 0) {
+    reclaim_pages(table);
+  }
+  collect_garbage(table);
+  ExecuteResult result = execute_statement(statement, table);
+  end_overwrites(table);
+  unblock_appends(table);
+  return result;
+}
+
+/*
+ * Fills `batch` with the scan's next rows, pointing into the pages. Returns
+ * why it stopped short, if it did: EXECUTE_SUCCESS at the end of the table,
+ * or the scan being interrupted. An interrupted scan still hands out the
+ * rows it's got, and stops on the next call.
+ */
+ExecuteResult fill_batch(Statement *statement, RowBatch *batch) {
+  Cursor *cursor = &(statement->cursor);
+  while (batch->num_rows < ROW_BATCH_SIZE && !cursor_end_of_table(cursor)) {
+    ExecuteResult check = check_interrupt(statement);
+    if (check != EXECUTE_ROW) {
+      return check;
+    }
+    void *row = cursor_value(cursor);
+    uint32_t i = batch->num_rows;
+    memcpy(&(batch->ids[i]), row + ID_OFFSET, ID_SIZE);
+    batch->usernames[i] = row + USERNAME_OFFSET;
+    batch->emails[i] = row + EMAIL_OFFSET;
+    batch->num_rows += 1;
+    cursor_advance(cursor);
+  }
+  return EXECUTE_SUCCESS;
+}
+
+// fill_batch for a statement on a reader handle: the rows are copied into
+// the batch
+ExecuteResult fill_batch_copy(Statement *statement, RowBatch *batch) {
+  DB *reader = statement->db;
+  Cursor *cursor = &(statement->cursor);
+  ExecuteResult result = EXECUTE_SUCCESS;
+  enter_epoch(reader);
+  while (batch->num_rows < ROW_BATCH_SIZE) {
+    ExecuteResult check = check_interrupt(statement);
+    if (check != EXECUTE_ROW) {
+      result = check;
+      break;
+    }
+    uint32_t i = batch->num_rows;
+    Row *copy = &(batch->copies[i]);
+    if (!read_next_row(reader->table, &cursor->row_num, cursor->snapshot,
+                       cursor->end_row_num, copy)) {
+      break;
+    }
+    batch->ids[i] = copy->id;
+    batch->usernames[i] = copy->username;
+    batch->emails[i] = copy->email;
+    batch->num_rows += 1;
+    cursor->row_num += 1;
+  }
+  exit_epoch(reader);
+  return result;
+}
+
+// db_step_batch on a partitioned handle: the rows db_step hands out from
+// the partitions' rounds (see step_partitioned_select), merged into this
+// batch. They're copied, since the next round can be read over them
+// before this batch is full
+ExecuteResult fill_batch_partitioned(Statement *statement, RowBatch *batch) {
+  ExecuteResult result = EXECUTE_SUCCESS;
+  while (batch->num_rows < ROW_BATCH_SIZE) {
+    result = db_step(statement);
+    if (result != EXECUTE_ROW) {
+      break;
+    }
+    uint32_t i = batch->num_rows;
+    Row *copy = &(batch->copies[i]);
+    *copy = *(Row *)statement->current_row;
+    batch->ids[i] = copy->id;
+    batch->usernames[i] = copy->username;
+    batch->emails[i] = copy->email;
+    batch->num_rows += 1;
+  }
+  return batch->num_rows > 0 ? EXECUTE_ROW : result;
+}
+
+ExecuteResult db_step_batch(Statement *statement, RowBatch *batch) {
+  batch->num_rows = 0;
+  if (statement->type != STATEMENT_SELECT) {
+    return db_step(statement);
+  }
+  if (statement->db->partitions != NULL) {
+    return fill_batch_partitioned(statement, batch);
+  }
+  if (statement->is_done) {
+    return EXECUTE_SUCCESS;
+  }
+
+  open_scan(statement);
+  ExecuteResult result = statement->db->is_reader
+                             ? fill_batch_copy(statement, batch)
+                             : fill_batch(statement, batch);
+  if (batch->num_rows == 0) {
+    close_scan(statement);
+    return result;
+  }
+  return EXECUTE_ROW;
+}
+
+uint32_t db_column_int(Statement *statement, int column) {
+  // id is the only integer column
+  if (column != COLUMN_ID || statement->current_row == NULL) {
+    return 0;
+  }
+  uint32_t id;
+  memcpy(&id, statement->current_row + ID_OFFSET, ID_SIZE);
+  return id;
+}
+
+const char *db_column_text(Statement *statement, int column) {
+  if (statement->current_row == NULL) {
+    return NULL;
+  }
+  switch (column) {
+  case (COLUMN_USERNAME):
+    return statement->current_row + USERNAME_OFFSET;
+  case (COLUMN_EMAIL):
+    return statement->current_row + EMAIL_OFFSET;
+  default:
+    return NULL;
+  }
+}
+
+void db_finalize(Statement *statement) {
+  // stopping a scan early is free: there's no read-ahead to throw away
+  statement->current_row = NULL;
+  if (statement->db->partitions != NULL) {
+    close_partitioned_scan(statement);
+  } else {
+    close_scan(statement);
+  }
+}
+
+void db_interrupt(DB *db) {
+  // only an atomic add, so it's fine in a signal handler
+  __atomic_add_fetch(&db->num_interrupts, 1, __ATOMIC_RELAXED);
+}
+
+void db_cancel(Statement *statement) {
+  __atomic_store_n(&statement->is_cancelled, true, __ATOMIC_RELAXED);
+}
+
+void db_set_timeout(DB *db, uint32_t milliseconds) {
+  db->timeout_ms = milliseconds;
+}
+
+bool db_has_free_slot(DB *db) {
+  uint32_t row_num;
+  return db->partitions == NULL && !db->is_reader &&
+         find_free_slot(db->table, &row_num);
+}
+
+bool db_vacuum(DB *db) {
+  if (db->partitions != NULL) {
+    return vacuum_partitions(db);
+  }
+  Table *table = db->table;
+  // moving rows and closing the appends gate are the writer's alone
+  if (db->is_reader || table->transaction.is_open) {
+    return false;
+  }
+
+  // still done in small steps, so this is the same code path autovacuum
+  // uses, just run until there's nothing left
+  block_appends(table);
+  while (vacuum_step(table, VACUUM_STEP_ROWS)) {
+  }
+  end_overwrites(table);
+  unblock_appends(table);
+  return true;
+}
+
+ImportResult db_import(DB *db, const char *path, uint32_t *num_rows_imported,
+                       uint32_t *bad_line_number) {
+  if (db->is_reader) {
+    return IMPORT_READ_ONLY;
+  }
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return IMPORT_CANNOT_OPEN;
+  }
+  struct stat file_stat;
+  fstat(fd, &file_stat);
+  size_t length = file_stat.st_size;
+  if (length == 0) {
+    close(fd);
+    *num_rows_imported = 0;
+    return IMPORT_SUCCESS;
+  }
+
+  const char *data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return IMPORT_CANNOT_OPEN;
+  }
+
+  size_t path_length = strlen(path);
+  bool is_tsv =
+      path_length >= 4 && strcmp(path + path_length - 4, ".tsv") == 0;
+
+  ImportResult result;
+  if (db->partitions != NULL) {
+    result = import_partitioned_rows(db, data, length, is_tsv ? '\t' : ',',
+                                     num_rows_imported, bad_line_number);
+  } else {
+    block_appends(db->table);
+    result = import_rows(db->table, data, length, is_tsv ? '\t' : ',',
+                         num_rows_imported, bad_line_number);
+    unblock_appends(db->table);
+  }
+  munmap((void *)data, length);
+  return result;
+}
+
+ExportResult db_export(DB *db, const char *path, bool is_binary,
+                       uint32_t *num_rows_exported) {
+  // only reads, but it closes the appends gate to get a still table
+  if (db->is_reader) {
+    return EXPORT_READ_ONLY;
+  }
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    return EXPORT_CANNOT_OPEN;
+  }
+
+  ExportResult result;
+  if (db->partitions != NULL) {
+    result = export_partitions(db, fd, is_binary, num_rows_exported);
+  } else {
+    block_appends(db->table);
+    result = is_binary ? export_binary(db->table, fd, num_rows_exported)
+                       : export_csv(db->table, fd, num_rows_exported);
+    unblock_appends(db->table);
+  }
+  close(fd);
+  return result;
+}
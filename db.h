@@ -0,0 +1,319 @@
+#ifndef DB_H
+#define DB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Public API of the database engine.
+ *
+ * The REPL in main.c is just one client of this; anything else can link
+ * db.c in and talk to the engine in-process, without going through stdin
+ * and stdout. The shape follows sqlite's C API:
+ *
+ *   DB *db = db_open();
+ *   Statement statement;
+ *   if (db_prepare(db, sql, strlen(sql), &statement) == PREPARE_SUCCESS) {
+ *     while (db_step(&statement) == EXECUTE_ROW) {
+ *       db_column_int(&statement, 0);
+ *       db_column_text(&statement, 1);
+ *     }
+ *     db_finalize(&statement);
+ *   }
+ *   db_close(db);
+ */
+
+typedef enum {
+  EXECUTE_SUCCESS,
+  EXECUTE_ROW,
+  EXECUTE_TABLE_FULL,
+  EXECUTE_DUPLICATE_KEY,
+  EXECUTE_TRANSACTION_ALREADY_OPEN,
+  EXECUTE_NO_TRANSACTION,
+  EXECUTE_INTERRUPTED,
+  EXECUTE_TIMED_OUT,
+  EXECUTE_READ_ONLY
+} ExecuteResult;
+typedef enum {
+  PREPARE_SUCCESS,
+  PREPARE_SYNTAX_ERROR,
+  PREPARE_NEGATIVE_ID,
+  PREPARE_ID_OUT_OF_RANGE,
+  PREPARE_STRING_TOO_LONG,
+  PREPARE_UNRECOGNIZED_STATEMENT
+} PrepareResult;
+typedef enum {
+  IMPORT_SUCCESS,
+  IMPORT_CANNOT_OPEN,
+  IMPORT_BAD_ROW,
+  IMPORT_STRING_TOO_LONG,
+  IMPORT_TABLE_FULL,
+  IMPORT_DUPLICATE_KEY,
+  IMPORT_READ_ONLY
+} ImportResult;
+typedef enum {
+  EXPORT_SUCCESS,
+  EXPORT_CANNOT_OPEN,
+  EXPORT_WRITE_FAILED,
+  EXPORT_READ_ONLY
+} ExportResult;
+typedef enum {
+  STATEMENT_INSERT,
+  STATEMENT_SELECT,
+  STATEMENT_UPDATE,
+  STATEMENT_DELETE,
+  STATEMENT_BEGIN,
+  STATEMENT_COMMIT,
+  STATEMENT_ROLLBACK
+} StatementType;
+
+// Called "preprocessor directives": performs text replacement before code
+// compiles. aka every instance of COLUMN_USERNAME_SIZE is replaced with 32 this
+// way, it doesn't take up memory in your program; the final code is just the
+// values
+#define COLUMN_USERNAME_SIZE 32
+#define COLUMN_EMAIL_SIZE 255
+
+// column numbers for db_column_int / db_column_text
+#define COLUMN_ID 0
+#define COLUMN_USERNAME 1
+#define COLUMN_EMAIL 2
+#define COLUMN_COUNT 3
+
+typedef struct {
+  uint32_t id;
+  //+ 1 bc in C, strings supposed to end w null character
+  char username[COLUMN_USERNAME_SIZE + 1];
+  char email[COLUMN_EMAIL_SIZE + 1];
+} Row;
+
+// an open database. What's inside is private to db.c
+typedef struct DB DB;
+typedef struct Table Table;
+
+/*
+ * A position in the table, used to walk it row by row, and the snapshot it
+ * walks: the commit stamp as of the scan's first step. Rows written after
+ * that don't show up and rows changed or deleted after it still do, as they
+ * were. It stops at end_row_num, the end of the table back then, which is
+ * what keeps out rows appended since (see db_open_appender).
+ */
+typedef struct {
+  Table *table;
+  uint32_t row_num;
+  uint64_t snapshot;
+  uint32_t end_row_num;
+} Cursor;
+
+/*
+ * Up to ROW_BATCH_SIZE rows of a select, one array per column. The strings
+ * point straight into the table's pages instead of being copied out, so
+ * they're only good until the table is next written to.
+ *
+ * On a reader handle (see db_open_reader) the rows are copied into `copies`
+ * instead, and the strings point there.
+ */
+#define ROW_BATCH_SIZE 64
+
+typedef struct {
+  uint32_t num_rows;
+  uint32_t ids[ROW_BATCH_SIZE];
+  const char *usernames[ROW_BATCH_SIZE];
+  const char *emails[ROW_BATCH_SIZE];
+  Row copies[ROW_BATCH_SIZE];
+} RowBatch;
+
+typedef struct Statement {
+  DB *db;
+  StatementType type;
+  Row row_to_insert;
+  // `insert or replace` / `on conflict(id) do update`: overwrite the row if
+  // the id already exists instead of failing
+  bool is_upsert;
+  // update/delete only touch rows matching `where id = <where_id>`
+  uint32_t where_id;
+  // new column values for update; set_* says which ones the `set` assigned
+  Row row_to_update;
+  bool set_username;
+  bool set_email;
+
+  // select: where the scan is, and the row db_step last handed out
+  Cursor cursor;
+  void *current_row;
+  // on a reader handle, current_row points at this copy of the row
+  Row row_copy;
+  // set between a select's first db_step and its last (or db_finalize)
+  bool is_scan_open;
+  // where the scan's snapshot is registered while it's open
+  uint32_t snapshot_slot;
+  // on a partitioned handle, a scan of each partition with the batch of
+  // rows it last read, and the partition whose batch db_step is on
+  struct PartitionScan *partition_scans;
+  uint32_t partition_num;
+
+  // see db_interrupt, db_cancel and db_set_timeout
+  uint32_t num_interrupts_at_prepare;
+  bool is_cancelled;
+  uint32_t timeout_ms;
+  // when the select has to be done by, on CLOCK_MONOTONIC in nanoseconds.
+  // 0 for no limit
+  uint64_t deadline;
+  // the next row at which the scan checks whether it should stop
+  uint32_t next_check_row;
+  // every other statement runs once; after that db_step just reports done
+  // (and so does a select that has run out of rows)
+  bool is_done;
+} Statement;
+
+DB *db_open();
+void db_close(DB *db);
+
+/*
+ * A second handle on `db`'s table for a thread that only reads. Any number
+ * of threads can run selects on their own reader handles while the thread
+ * that owns `db` keeps writing, without either side ever waiting on the
+ * other. A reader's selects copy each row out as they go (so nothing they
+ * return changes under them) and, like every select, see the table as of
+ * their first step, committed writes only. Anything but a select returns
+ * EXECUTE_READ_ONLY, db_import and db_export return IMPORT_READ_ONLY and
+ * EXPORT_READ_ONLY, and db_vacuum returns false.
+ *
+ * While a select is open on any handle, updates write new versions of
+ * rows rather than changing them in place, so they need a free slot like
+ * an insert does; so do updates inside a transaction while any reader
+ * handle is open. A select on a reader that starts while the writer is
+ * changing a row in place waits for that one statement to finish.
+ *
+ * Open it from the thread that owns `db`; after that a handle is for one
+ * thread at a time. NULL if there are too many readers. Close them all
+ * with db_close before closing `db`.
+ */
+DB *db_open_reader(DB *db);
+
+/*
+ * A reader handle that can also insert. Any number of threads can insert
+ * on appender handles at once, alongside the readers, without a lock on
+ * the table. Inserts are buffered on the handle and go in the table a batch
+ * at a time, at the end, claiming their slots with one atomic add.
+ *
+ * A buffered row is in the table once it's flushed: when the buffer fills
+ * up, on db_flush, at the handle's own next select, at db_close, and
+ * whenever the thread that owns `db` writes. Until then other handles'
+ * selects don't see it. A duplicate id is still reported by the insert
+ * itself, and so is a full table.
+ *
+ * Only plain inserts; `insert or replace`, updates and deletes still
+ * return EXECUTE_READ_ONLY. Appended rows always go at the end of the
+ * table, never in holes left by deletes, so while db_has_free_slot says
+ * there are any, inserts are better run on `db` itself.
+ *
+ * Appends wait while the thread that owns `db` is writing, and from its
+ * BEGIN to its COMMIT or ROLLBACK.
+ */
+DB *db_open_appender(DB *db);
+
+// puts an appender's buffered inserts in the table. Nothing on other handles
+void db_flush(DB *db);
+
+/*
+ * A database whose table is split into `num_partitions` partitions by a
+ * hash of the id, each with its own pages, index and lock, and each
+ * holding as many rows as a whole table otherwise would.
+ *
+ * Unlike other handles, any number of threads can run statements on this
+ * one at once. An insert, update or delete only locks its id's partition,
+ * so writes to different partitions run in parallel. A select sees every
+ * partition as of its first step, and reads them all in parallel several
+ * batches at a time, so rows don't come back in insert order. Vacuum, import and
+ * export work on the partitions in parallel too, and export sees each
+ * partition as of when it gets to it.
+ *
+ * A transaction locks every partition from BEGIN to COMMIT or ROLLBACK:
+ * other threads' statements wait for it to end. There are no reader or
+ * appender handles on a partitioned table (db_open_reader returns NULL);
+ * threads just share this one. NULL for 0 or more than 64 partitions.
+ */
+DB *db_open_partitioned(uint32_t num_partitions);
+
+/*
+ * Parses the `sql_length` bytes at `sql` into `statement`. The statement is
+ * filled in place, so it can live on the caller's stack.
+ *
+ * `sql` doesn't have to be null-terminated and is only read, never written,
+ * and parsing doesn't allocate. Any number of threads can prepare
+ * statements at the same time.
+ */
+PrepareResult db_prepare(DB *db, const char *sql, size_t sql_length,
+                         Statement *statement);
+
+/*
+ * Runs the statement. A select returns EXECUTE_ROW once per row, with the
+ * row readable through db_column_*, and EXECUTE_SUCCESS when there are no
+ * rows left. Everything else returns EXECUTE_SUCCESS or an error.
+ *
+ * Rows are only produced when asked for, so a caller can stop whenever it
+ * wants (just db_finalize) and nothing gets read ahead or buffered. Other
+ * statements can run in between steps, on this handle or another thread;
+ * the select still returns the table as it was at its first step, and
+ * never holds them up.
+ */
+ExecuteResult db_step(Statement *statement);
+
+/*
+ * Like db_step for a select, but fills `batch` with the next rows at once.
+ * Returns EXECUTE_ROW while there were rows to hand out and EXECUTE_SUCCESS
+ * (with an empty batch) once the scan is done.
+ */
+ExecuteResult db_step_batch(Statement *statement, RowBatch *batch);
+
+// Values of the current row. Text is read in place from the page, valid
+// until the next db_step or write.
+uint32_t db_column_int(Statement *statement, int column);
+const char *db_column_text(Statement *statement, int column);
+
+void db_finalize(Statement *statement);
+
+/*
+ * Stopping runaway selects. A select that's been interrupted, cancelled or
+ * has run out of time returns EXECUTE_INTERRUPTED or EXECUTE_TIMED_OUT from
+ * its next db_step, and is done. Rows it already handed out stay handed
+ * out. It only checks every few pages, so it may get a few more rows out
+ * first. Every other statement touches one row and just finishes.
+ */
+
+// interrupts every statement running on `db` right now (not the ones
+// prepared after). Safe to call from another thread or a signal handler
+void db_interrupt(DB *db);
+// interrupts just this statement
+void db_cancel(Statement *statement);
+// selects prepared from now on time out `milliseconds` after their first
+// db_step. 0 (the default) means no limit
+void db_set_timeout(DB *db, uint32_t milliseconds);
+
+// true if an insert on `db` would go in a slot freed by a delete rather
+// than at the end of the table, where appender handles put every row
+bool db_has_free_slot(DB *db);
+
+// compacts the table all the way. false if a transaction is open, or on a
+// reader or appender handle
+bool db_vacuum(DB *db);
+
+/*
+ * Loads every `id,username,email` line of a CSV file (tab separated if the
+ * name ends in .tsv), parsing it on several threads. Either every row goes
+ * in or none do; on IMPORT_BAD_ROW / IMPORT_STRING_TOO_LONG
+ * `bad_line_number` says which line was wrong.
+ */
+ImportResult db_import(DB *db, const char *path, uint32_t *num_rows_imported,
+                       uint32_t *bad_line_number);
+
+/*
+ * Writes every live row to `path`, as `id,username,email` lines that
+ * db_import can read back, or with `is_binary` as a raw copy of the pages
+ * (on a partitioned table, each partition's one after another).
+ */
+ExportResult db_export(DB *db, const char *path, bool is_binary,
+                       uint32_t *num_rows_exported);
+
+#endif
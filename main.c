@@ -1,8 +1,18 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "db.h"
+#include "server.h"
 
 typedef struct {
   char *buffer;
@@ -10,122 +20,11 @@ typedef struct {
   ssize_t input_length;
 } InputBuffer;
 
-typedef enum { EXECUTE_SUCCESS, EXECUTE_TABLE_FULL } ExecuteResult;
 typedef enum {
   META_COMMAND_SUCCESS,
+  META_COMMAND_EXIT,
   META_COMMAND_UNRECOGNIZED_COMMAND
 } MetaCommandResult;
-typedef enum {
-  PREPARE_SUCCESS,
-  PREPARE_SYNTAX_ERROR,
-  PREPARE_NEGATIVE_ID,
-  PREPARE_STRING_TOO_LONG,
-  PREPARE_UNRECOGNIZED_STATEMENT
-} PrepareResult;
-typedef enum { STATEMENT_INSERT, STATEMENT_SELECT } StatementType;
-
-// Called "preprocessor directives": performs text replacement before code
-// compiles. aka every instance of COLUMN_USERNAME_SIZE is replaced with 32 this
-// way, it doesn't take up memory in your program; the final code is just the
-// values
-#define COLUMN_USERNAME_SIZE 32
-#define COLUMN_EMAIL_SIZE 255
-
-typedef struct {
-  uint32_t id;
-  //+ 1 bc in C, strings supposed to end w null character
-  char username[COLUMN_USERNAME_SIZE + 1];
-  char email[COLUMN_EMAIL_SIZE + 1];
-} Row;
-
-typedef struct {
-  StatementType type;
-  Row row_to_insert;
-} Statement;
-
-/*
- * TLDR: this is a utility macro to get the byte size of a specific attribute
- * within struct without needing to create an actual instance of the struct.
- *
- * "hey compiler, if this were a real Struct pointer, I want to access
- * Attribute"
- *
- * Breakdown:
- * - Struct*                    creates a pointer
- * - (Struct*)0                 creates a NULL pointer by casting a 0, since 0
- * is not a valid memory address
- * - ((Struct *)0)->Attribute   gets the Attribute type info from Struct through
- * a NULL pointer
- *
- * */
-#define size_of_attribute(Struct, Attribute) sizeof(((Struct *)0)->Attribute)
-
-const uint32_t ID_SIZE = size_of_attribute(Row, id);             // 4 bytes
-const uint32_t USERNAME_SIZE = size_of_attribute(Row, username); // 32 bytes
-const uint32_t EMAIL_SIZE = size_of_attribute(Row, email);       // 255 bytes
-const uint32_t ID_OFFSET = 0;
-const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
-const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
-const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
-
-/*
- * Serialization is the process of converting a data structure
- * (in this case a Row struct) into a format that can be stored
- * or transmitted (a contiguous memory block)
- *
- * Each memcpy call copies the specific Row instance's field to a predetermined
- * location in the destination memory block
- */
-void serialize_row(Row *row_byte_address, void *row_location_in_page) {
-  /*
-   * memcp copies n chars from src to dest.
-   *
-   * void *memcpy(void *dst, const void *src, size_t n)
-   * ^^ notice the `const void *src` syntax
-   * `const` is a hint that *src shouldn't be modified.
-   *
-   * memcpy(destination address, source address to copy bytes from, number of
-   * bytes to copy)
-   */
-
-  // being painfully explicity here
-  uint32_t *row_id_position = (uint32_t *)(row_location_in_page + ID_OFFSET);
-  memcpy(row_id_position, &(row_byte_address->id), ID_SIZE);
-
-  memcpy(row_location_in_page + USERNAME_OFFSET, &(row_byte_address->username),
-         USERNAME_SIZE);
-  memcpy(row_location_in_page + EMAIL_OFFSET, &(row_byte_address->email),
-         EMAIL_SIZE);
-}
-
-/*
- * Reverses the serialization process by copying bytes from a memory block
- * back into a structured Row object, using predefined offsets to locate
- * each field's original position in the sorted memory block
- */
-void deserialize_row(void *row_byte_address, Row *row_location_in_page) {
-  memcpy(&(row_location_in_page->id), row_byte_address + ID_OFFSET, ID_SIZE);
-  memcpy(&(row_location_in_page->username), row_byte_address + USERNAME_OFFSET,
-         USERNAME_SIZE);
-  memcpy(&(row_location_in_page->email), row_byte_address + EMAIL_OFFSET,
-         EMAIL_SIZE);
-}
-
-// Table structure that points to pages of rows and keeps tracks of how many
-// rows there are in prepare_statement
-
-// 4KB; equivalent to a page in most VMs.
-// This way 1 page in our DB is 1 page in the OS, so it's treated as a single
-// unit
-const uint32_t PAGE_SIZE = 4096;
-#define TABLE_MAX_PAGES 100
-const uint32_t ROWS_PER_PAGE = PAGE_SIZE / ROW_SIZE;
-const uint32_t TABLE_MAX_ROWS = ROWS_PER_PAGE * TABLE_MAX_PAGES;
-
-typedef struct {
-  uint32_t num_rows;
-  void *pages[TABLE_MAX_PAGES]; // array of pointers
-} Table;
 
 void print_prompt() { printf("db > "); }
 
@@ -169,213 +68,421 @@ InputBuffer *new_input_buffer() {
   return input_buffer;
 }
 
-Table *new_table() {
-  // allocate memory and cast Table pointer
-  //
-  // Explanation:
-  // malloc returns a generic pointer void*
-  // so `(Table*)malloc(sizeof(Table))` is saying,
-  // "the pointer of that address that we just allocated is of type Table"
-  Table *table = (Table *)malloc(sizeof(Table));
-
-  table->num_rows = 0;
-
-  // defensive programming:
-  // apparently good practice in C to instantiate null pointers
-  // bc it can end up being filled with whatever random memory values present in
-  // that memory location
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    table->pages[i] = NULL;
-  }
-  return table;
+void print_row(Statement *statement) {
+  printf("(%d, %s, %s)\n", db_column_int(statement, COLUMN_ID),
+         db_column_text(statement, COLUMN_USERNAME),
+         db_column_text(statement, COLUMN_EMAIL));
 }
 
-// cleanup table
-void free_table(Table *table) {
-  for (int i = 0; table->pages[i]; i++) {
-    free(table->pages[i]);
-  }
-  free(table);
+// true if the `length` bytes at `line` are exactly `command`
+bool is_command(const char *line, size_t length, const char *command) {
+  return length == strlen(command) && memcmp(line, command, length) == 0;
 }
 
-MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table *table) {
-  bool is_exit_command = strcmp(input_buffer->buffer, ".exit") == 0;
-  if (is_exit_command) {
-    close_input_buffer(input_buffer);
-    free_table(table);
-    exit(EXIT_SUCCESS);
+// copies the path argument of a meta command into a null-terminated buffer
+bool get_path_argument(const char *argument, size_t length, char *path) {
+  if (length == 0 || length >= PATH_MAX) {
+    return false;
   }
-  return META_COMMAND_UNRECOGNIZED_COMMAND;
+  memcpy(path, argument, length);
+  path[length] = '\0';
+  return true;
 }
 
-PrepareResult prepare_insert(InputBuffer *input_buffer, Statement *statement) {
-  statement->type = STATEMENT_INSERT;
-
-  // Splits each attribute by spaces
-  // like doing .split(' ') in Typescript
-  char *keyword = strtok(input_buffer->buffer, " ");
-  char *id_string = strtok(NULL, " ");
-  char *username = strtok(NULL, " ");
-  char *email = strtok(NULL, " ");
-
-  if (id_string == NULL || username == NULL || email == NULL) {
-    return PREPARE_SYNTAX_ERROR;
+void import_file(DB *db, const char *argument, size_t length) {
+  char path[PATH_MAX];
+  if (!get_path_argument(argument, length, path)) {
+    printf("Syntax error. Could not parse statement.\n");
+    return;
   }
 
-  // atoi converts string to int
-  int id = atoi(id_string);
-  if (id < 0) {
-    return PREPARE_NEGATIVE_ID;
-  }
-  if (strlen(username) > COLUMN_USERNAME_SIZE) {
-    return PREPARE_STRING_TOO_LONG;
+  uint32_t num_rows;
+  uint32_t bad_line_number;
+  switch (db_import(db, path, &num_rows, &bad_line_number)) {
+  case (IMPORT_SUCCESS):
+    printf("Imported %u rows.\n", num_rows);
+    break;
+  case (IMPORT_CANNOT_OPEN):
+    printf("Error: Could not open '%s'.\n", path);
+    break;
+  case (IMPORT_BAD_ROW):
+    printf("Error: Could not parse line %u of '%s'.\n", bad_line_number, path);
+    break;
+  case (IMPORT_STRING_TOO_LONG):
+    printf("Error: String is too long on line %u of '%s'.\n", bad_line_number,
+           path);
+    break;
+  case (IMPORT_TABLE_FULL):
+    printf("Error: Table full.\n");
+    break;
+  case (IMPORT_DUPLICATE_KEY):
+    printf("Error: Duplicate key.\n");
+    break;
+  case (IMPORT_READ_ONLY):
+    printf("Error: Read only.\n");
+    break;
   }
-  if (strlen(email) > COLUMN_EMAIL_SIZE) {
-    return PREPARE_STRING_TOO_LONG;
+}
+
+// .export <path> writes csv, .export binary <path> copies the pages
+void export_file(DB *db, const char *argument, size_t length) {
+  bool is_binary = length > 7 && memcmp(argument, "binary ", 7) == 0;
+  if (is_binary) {
+    argument += 7;
+    length -= 7;
   }
 
-  // store the values
-  statement->row_to_insert.id = id;
-  strcpy(statement->row_to_insert.username, username);
-  strcpy(statement->row_to_insert.email, email);
+  char path[PATH_MAX];
+  if (!get_path_argument(argument, length, path)) {
+    printf("Syntax error. Could not parse statement.\n");
+    return;
+  }
 
-  return PREPARE_SUCCESS;
+  uint32_t num_rows;
+  switch (db_export(db, path, is_binary, &num_rows)) {
+  case (EXPORT_SUCCESS):
+    printf("Exported %u rows.\n", num_rows);
+    break;
+  case (EXPORT_CANNOT_OPEN):
+    printf("Error: Could not open '%s'.\n", path);
+    break;
+  case (EXPORT_WRITE_FAILED):
+    printf("Error: Could not write '%s'.\n", path);
+    break;
+  case (EXPORT_READ_ONLY):
+    printf("Error: Read only.\n");
+    break;
+  }
 }
 
-PrepareResult prepare_statement(InputBuffer *input_buffer,
-                                Statement *statement) {
-  if (strcmp(input_buffer->buffer, "select") == 0) {
-    statement->type = STATEMENT_SELECT;
-    return PREPARE_SUCCESS;
+// .timeout <ms> limits how long each select may run from then on; 0 turns
+// it off
+void set_timeout(DB *db, const char *argument, size_t length) {
+  char *end;
+  char number[16];
+  if (length == 0 || length >= sizeof(number)) {
+    printf("Syntax error. Could not parse statement.\n");
+    return;
   }
-  if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
-    return prepare_insert(input_buffer, statement);
+  memcpy(number, argument, length);
+  number[length] = '\0';
+  unsigned long milliseconds = strtoul(number, &end, 10);
+  if (*end != '\0' || number[0] == '-' || milliseconds > UINT32_MAX) {
+    printf("Syntax error. Could not parse statement.\n");
+    return;
   }
+  db_set_timeout(db, milliseconds);
+}
 
-  return PREPARE_UNRECOGNIZED_STATEMENT;
+MetaCommandResult do_meta_command(const char *command, size_t length,
+                                  DB *db) {
+  if (is_command(command, length, ".exit")) {
+    return META_COMMAND_EXIT;
+  }
+  if (is_command(command, length, ".vacuum")) {
+    if (!db_vacuum(db)) {
+      printf("Error: Cannot vacuum inside a transaction.\n");
+    }
+    return META_COMMAND_SUCCESS;
+  }
+  if (length > 8 && memcmp(command, ".import ", 8) == 0) {
+    import_file(db, command + 8, length - 8);
+    return META_COMMAND_SUCCESS;
+  }
+  if (length > 8 && memcmp(command, ".export ", 8) == 0) {
+    export_file(db, command + 8, length - 8);
+    return META_COMMAND_SUCCESS;
+  }
+  if (length > 9 && memcmp(command, ".timeout ", 9) == 0) {
+    set_timeout(db, command + 9, length - 9);
+    return META_COMMAND_SUCCESS;
+  }
+  return META_COMMAND_UNRECOGNIZED_COMMAND;
 }
 
-// Figures out where to read/write a particular row in memory
-void *get_row_location(Table *table, uint32_t row_num) {
-  // Calculate which page contains this row
-  uint32_t page_num = row_num / ROWS_PER_PAGE;
+// the database ctrl-c interrupts
+DB *interruptible_db;
+// ctrl-c's since the last statement finished
+volatile sig_atomic_t num_unanswered_interrupts;
 
-  // If the page doesn't exist yet, create it
-  if (table->pages[page_num] == NULL) {
-    table->pages[page_num] = malloc(PAGE_SIZE);
+/*
+ * Ctrl-c stops the statement that's running instead of killing the process
+ * and the whole in-memory table with it. Pressed three times with nothing
+ * finishing in between it still quits, like sqlite's shell.
+ */
+void handle_interrupt(int signal_number) {
+  (void)signal_number;
+  num_unanswered_interrupts += 1;
+  if (num_unanswered_interrupts >= 3) {
+    _exit(EXIT_FAILURE);
   }
+  db_interrupt(interruptible_db);
+}
 
-  // Get a pointer to the start of the page
-  void *page_start = table->pages[page_num];
-
-  /*
-   * get row position by doing modulo %
-   * it's perfect for getting a "position"
-   *
-   * say ROWS_PER_PAGE = 10.
-   * if row_num is 0-9, % 10 will be those numbers (0-9)
-   * if row_num is 11, % 10 = 1 (first position in next page)
-   * if row_num is 15, % 10 = 5 (fifth position in next page)
-   * if row_num is 25, % 10 = 5 (fifth position in third page)
-   *
-   * So row_position_in_page always gives you the row's position within its
-   * specific page, regardless of which page it's on.
-   */
-  uint32_t row_position_in_page = row_num % ROWS_PER_PAGE;
-
-  // `row_position_in_page * ROW_SIZE` calculates how many bytes you need to
-  // move from the start of the page to its specific row
-  void *row_location = page_start + (row_position_in_page * ROW_SIZE);
-
-  return row_location;
+void catch_interrupts(DB *db) {
+  interruptible_db = db;
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handle_interrupt;
+  sigemptyset(&action.sa_mask);
+  // the prompt's read (or a write of a row) just carries on afterwards
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGINT, &action, NULL);
 }
 
-ExecuteResult execute_insert(Statement *statement, Table *table) {
-  if (table->num_rows == TABLE_MAX_ROWS) {
-    return EXECUTE_TABLE_FULL;
+/*
+ * Runs one line of input (`length` bytes, not null-terminated), either a
+ * meta command or a statement, and prints what it returns. `is_script`
+ * drops the "Executed." acknowledgements, which only mean something to
+ * someone typing at the prompt.
+ *
+ * Returns false once the input asks to .exit
+ */
+bool run_line(DB *db, const char *line, size_t length, bool is_script) {
+  bool is_valid_meta_command = length > 0 && line[0] == '.';
+  if (is_valid_meta_command) {
+    switch (do_meta_command(line, length, db)) {
+    case (META_COMMAND_SUCCESS):
+      return true;
+    case (META_COMMAND_EXIT):
+      return false;
+    case (META_COMMAND_UNRECOGNIZED_COMMAND):
+      printf("Unrecognized command '%.*s'\n", (int)length, line);
+      return true;
+    }
   }
 
-  Row *row_to_insert = &(statement->row_to_insert);
+  // convert input to bytecode for sqlite to process as sql statement
+  Statement statement;
+  // reminder: &statement CREATES a pointer to statement (gets memory address)
+  switch (db_prepare(db, line, length, &statement)) {
+  case (PREPARE_SUCCESS):
+    break;
+  case (PREPARE_NEGATIVE_ID):
+    printf("ID must be positive.\n");
+    return true;
+  case (PREPARE_ID_OUT_OF_RANGE):
+    printf("ID is out of range.\n");
+    return true;
+  case (PREPARE_STRING_TOO_LONG):
+    printf("String is too long.\n");
+    return true;
+  case (PREPARE_SYNTAX_ERROR):
+    printf("Syntax error. Could not parse statement.\n");
+    return true;
+  case (PREPARE_UNRECOGNIZED_STATEMENT):
+    printf("Unrecognized keyword at start of '%.*s' .\n", (int)length, line);
+    return true;
+  default:
+    printf("Syntax error.");
+    break;
+  }
 
-  serialize_row(row_to_insert, get_row_location(table, table->num_rows));
-  table->num_rows += 1;
+  // a select hands back its rows one db_step at a time
+  ExecuteResult result;
+  while ((result = db_step(&statement)) == EXECUTE_ROW) {
+    print_row(&statement);
+  }
+  db_finalize(&statement);
+  num_unanswered_interrupts = 0;
 
-  return EXECUTE_SUCCESS;
+  switch (result) {
+  case (EXECUTE_SUCCESS):
+    if (!is_script) {
+      printf("Executed.\n");
+    }
+    break;
+  case (EXECUTE_ROW):
+    break;
+  case (EXECUTE_TABLE_FULL):
+    printf("Error: Table full.\n");
+    break;
+  case (EXECUTE_DUPLICATE_KEY):
+    printf("Error: Duplicate key.\n");
+    break;
+  case (EXECUTE_TRANSACTION_ALREADY_OPEN):
+    printf("Error: Transaction already open.\n");
+    break;
+  case (EXECUTE_NO_TRANSACTION):
+    printf("Error: No transaction is open.\n");
+    break;
+  case (EXECUTE_INTERRUPTED):
+    printf("Error: Interrupted.\n");
+    break;
+  case (EXECUTE_TIMED_OUT):
+    printf("Error: Statement timed out.\n");
+    break;
+  case (EXECUTE_READ_ONLY):
+    printf("Error: Read only.\n");
+    break;
+  }
+  return true;
 }
 
-void print_row(Row *row) {
-  printf("(%d, %s, %s)\n", row->id, row->username, row->email);
-}
+/*
+ * Batch mode (./db -f script.sql): runs every line of the file, with no
+ * prompt and no "Executed." after each statement.
+ *
+ * Instead of getline-ing the file into a buffer line by line, the whole
+ * file is mmap'd read-only and each statement is parsed right where it sits
+ * in the mapping; db_prepare takes a length, so lines don't even need to be
+ * null-terminated.
+ */
+void run_script(DB *db, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    printf("Unable to open file '%s'\n", path);
+    exit(EXIT_FAILURE);
+  }
 
-// print every row
-ExecuteResult execute_select(Statement *statement, Table *table) {
-  Row row;
-  for (uint32_t row_num = 0; row_num < table->num_rows; row_num++) {
-    deserialize_row(get_row_location(table, row_num), &row);
-    print_row(&row);
+  struct stat file_stat;
+  fstat(fd, &file_stat);
+  size_t script_length = file_stat.st_size;
+  if (script_length == 0) {
+    close(fd);
+    return;
   }
-  return EXECUTE_SUCCESS;
+
+  const char *script =
+      mmap(NULL, script_length, PROT_READ, MAP_PRIVATE, fd, 0);
+  // the mapping stays valid after the fd is closed
+  close(fd);
+  if (script == MAP_FAILED) {
+    printf("Unable to map file '%s'\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  const char *end = script + script_length;
+  const char *line = script;
+  while (line < end) {
+    const char *newline = memchr(line, '\n', end - line);
+    const char *line_end = newline != NULL ? newline : end;
+
+    size_t length = line_end - line;
+    if (length > 0 && line[length - 1] == '\r') {
+      length--;
+    }
+    if (length > 0 && !run_line(db, line, length, true)) {
+      break;
+    }
+    line = line_end + 1;
+  }
+
+  munmap((void *)script, script_length);
 }
 
-ExecuteResult execute_statement(Statement *statement, Table *table) {
-  switch (statement->type) {
-  case (STATEMENT_SELECT):
-    return execute_select(statement, table);
-  case (STATEMENT_INSERT):
-    return execute_insert(statement, table);
+// the client asks for columnar results, so there's no text to parse back
+void print_client_batch(const ColumnBatch *batch, void *context) {
+  (void)context;
+  for (uint32_t i = 0; i < batch->num_rows; i++) {
+    int32_t username_start = batch->username_offsets[i];
+    int32_t email_start = batch->email_offsets[i];
+    printf("(%u, %.*s, %.*s)\n", batch->ids[i],
+           batch->username_offsets[i + 1] - username_start,
+           batch->usernames + username_start,
+           batch->email_offsets[i + 1] - email_start,
+           batch->emails + email_start);
   }
 }
 
-int main(int argc, char **argv) {
-  Table *table = new_table();
-  InputBuffer *input_buffer = new_input_buffer();
+/*
+ * Client mode (./db -c /tmp/db.sock): the same prompt, but statements run
+ * on a server started with -s on the same machine, over shared memory.
+ */
+void run_client(const char *socket_path) {
+  Client *client = client_connect(socket_path);
+  if (client == NULL) {
+    printf("Unable to connect to '%s'\n", socket_path);
+    exit(EXIT_FAILURE);
+  }
 
-  // REPL
+  InputBuffer *input_buffer = new_input_buffer();
   while (true) {
     print_prompt();
     read_input(input_buffer);
-
-    bool is_valid_meta_command = input_buffer->buffer[0] == '.';
-    if (is_valid_meta_command) {
-      switch (do_meta_command(input_buffer, table)) {
-      case (META_COMMAND_SUCCESS):
-        continue;
-      case (META_COMMAND_UNRECOGNIZED_COMMAND):
-        printf("Unrecognized command '%s'\n", input_buffer->buffer);
-        continue;
-      }
-    }
-
-    // convert input to bytecode for sqlite to process as sql statement
-    Statement statement;
-    // reminder: &statement CREATES a pointer to statement (gets memory address)
-    switch (prepare_statement(input_buffer, &statement)) {
-    case (PREPARE_SUCCESS):
-      break;
-    case (PREPARE_NEGATIVE_ID):
-      printf("ID must be positive.\n");
-      continue;
-    case (PREPARE_STRING_TOO_LONG):
-      printf("String is too long.\n");
-      continue;
-    case (PREPARE_SYNTAX_ERROR):
-      printf("Syntax error. Could not parse statement.\n");
-      continue;
-    case (PREPARE_UNRECOGNIZED_STATEMENT):
-      printf("Unrecognized keyword at start of '%s' .\n", input_buffer->buffer);
-      continue;
-    default:
-      printf("Syntax error.");
+    if (is_command(input_buffer->buffer, input_buffer->input_length,
+                   ".exit")) {
       break;
     }
 
-    switch (execute_statement(&statement, table)) {
-    case (EXECUTE_SUCCESS):
+    char error_message[CLIENT_ERROR_MESSAGE_SIZE];
+    switch (client_execute_columnar(client, input_buffer->buffer,
+                                    input_buffer->input_length,
+                                    print_client_batch, NULL, error_message)) {
+    case (CLIENT_SUCCESS):
       printf("Executed.\n");
       break;
-    case (EXECUTE_TABLE_FULL):
-      printf("Error: Table full.\n");
+    case (CLIENT_ERROR):
+      printf("%s\n", error_message);
       break;
+    case (CLIENT_DISCONNECTED):
+      printf("Error: Lost the connection to the server.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  close_input_buffer(input_buffer);
+  client_close(client);
+}
+
+int main(int argc, char **argv) {
+  DB *db;
+  // ./db -p num_partitions [...]: the table's split into partitions by id,
+  // with everything else the same (see db_open_partitioned)
+  if (argc >= 3 && strcmp(argv[1], "-p") == 0) {
+    // the server's reader threads each need a reader handle, and a
+    // partitioned table has none
+    for (int i = 3; i < argc; i++) {
+      if (strcmp(argv[i], "-r") == 0) {
+        printf("Error: Reader threads aren't supported on a partitioned "
+               "table.\n");
+        return EXIT_FAILURE;
+      }
+    }
+    db = db_open_partitioned(strtoul(argv[2], NULL, 10));
+    if (db == NULL) {
+      printf("Error: Could not split the table into '%s' partitions.\n",
+             argv[2]);
+      return EXIT_FAILURE;
+    }
+    argc -= 2;
+    argv += 2;
+  } else {
+    db = db_open();
+  }
+
+  if (argc == 3 && strcmp(argv[1], "-f") == 0) {
+    run_script(db, argv[2]);
+    db_close(db);
+    return EXIT_SUCCESS;
+  }
+  if (argc == 3 && strcmp(argv[1], "-c") == 0) {
+    db_close(db);
+    run_client(argv[2]);
+    return EXIT_SUCCESS;
+  }
+  // ./db -s path [-r num_reader_threads]
+  if ((argc == 3 || (argc == 5 && strcmp(argv[3], "-r") == 0)) &&
+      strcmp(argv[1], "-s") == 0) {
+    uint32_t num_readers = argc == 5 ? strtoul(argv[4], NULL, 10) : 0;
+    bool is_served = run_server(db, argv[2], num_readers);
+    db_close(db);
+    return is_served ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  catch_interrupts(db);
+  InputBuffer *input_buffer = new_input_buffer();
+
+  // REPL
+  while (true) {
+    print_prompt();
+    read_input(input_buffer);
+
+    if (!run_line(db, input_buffer->buffer, input_buffer->input_length,
+                  false)) {
+      close_input_buffer(input_buffer);
+      db_close(db);
+      exit(EXIT_SUCCESS);
     }
   }
 }
@@ -0,0 +1,1525 @@
+#define _GNU_SOURCE // accept4
+
+#include "server.h"
+#include "shared_memory.h"
+
+#include <stdio.h>
+
+void put_u32(char *out, uint32_t value) {
+  out[0] = value;
+  out[1] = value >> 8;
+  out[2] = value >> 16;
+  out[3] = value >> 24;
+}
+
+uint32_t get_u32(const char *in) {
+  const unsigned char *bytes = (const unsigned char *)in;
+  return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+/*
+ * The server is a single thread running an epoll loop over non-blocking
+ * sockets. Statements are quick (everything's in memory), so running them
+ * right on the loop thread is cheaper than handing them off anywhere.
+ *
+ * Each connection has an input buffer that collects bytes until a whole
+ * request frame is there, and an output buffer for the responses that
+ * haven't been sent yet.
+ *
+ * Clients can pipeline: send any number of requests without waiting for
+ * the answers. Everything that has arrived is run in order and all the
+ * responses are collected and sent together, so a burst of small
+ * statements costs one send instead of one per statement.
+ *
+ * Each client's session is a coroutine with a small stack of its own (see
+ * run_session). It reads like a plain loop, "wait for a request, run it,
+ * repeat", but whenever it has to wait (for input, for another client's
+ * transaction, for its output to drain) it hands control back to the event
+ * loop instead of blocking, and the loop resumes it once there's something
+ * to do. Thousands of sessions cost thousands of small stacks, not
+ * thousands of threads.
+ *
+ * Statements don't run the moment they arrive, though: they're scheduled
+ * (see run_scheduled_sessions) so one client's big select can't starve
+ * everyone else's point lookups.
+ *
+ * With reader threads (./db -s path -r 4), selects don't run on the loop
+ * thread at all. Each one is pinned to a reader thread with a reader handle
+ * of its own (see db_open_reader), which steps it a slice at a time while
+ * the loop carries on writing. Selects then scale with cores, and a big
+ * one costs the loop little more than copying its rows out.
+ *
+ * The handles are appenders (see db_open_appender), so plain inserts go to
+ * the reader threads too and many clients' inserts run at once. Not while
+ * a transaction is open, though: they'd only wait for it on the reader
+ * thread, holding up its selects, so they run on the loop after it like
+ * everything else. A BEGIN waits for the inserts already out on reader
+ * threads to finish first. A reader thread buffers its inserts and only
+ * answers them once it's flushed them, a batch at a time.
+ */
+
+/*
+ * Statements come in two classes. Point statements (everything but select)
+ * touch one row through the index and finish in one go; scans (select)
+ * walk the whole table and run in slices of SESSION_SLICE_ROWS rows, going
+ * back into the queue after each one.
+ */
+typedef enum {
+  QUERY_CLASS_POINT,
+  QUERY_CLASS_SCAN,
+  NUM_QUERY_CLASSES
+} QueryClass;
+
+struct Connection;
+
+typedef struct {
+  struct Connection *head;
+  struct Connection *tail;
+  uint32_t length;
+} SessionQueue;
+typedef struct {
+  char *data;
+  size_t length;
+  size_t capacity;
+} Buffer;
+
+struct ReaderThread;
+
+// one slice of a select, run on a reader thread (see run_slice_on_reader)
+typedef struct ScanSlice {
+  // the reader the select is pinned to; NULL if it runs on the loop
+  struct ReaderThread *reader;
+  Statement *statement;
+  bool is_columnar;
+  // what the slice produced, for the loop to copy into the connection's
+  // output
+  Buffer output;
+  ExecuteResult result;
+  uint32_t num_rows;
+  // set by the reader thread once everything above is filled in
+  bool is_done;
+  struct ScanSlice *next;
+} ScanSlice;
+
+typedef struct ReaderThread {
+  DB *db;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t has_slices;
+  // slices waiting to run, oldest first
+  ScanSlice *slices;
+  ScanSlice *last_slice;
+  // poked whenever a slice is done
+  int slices_done_fd;
+} ReaderThread;
+
+typedef struct Connection {
+  int fd;
+  Buffer input;
+  Buffer output;
+  // how much of `output` has already gone out
+  size_t output_sent;
+  // bytes at the start of `input` that have already been run
+  size_t input_start;
+  // the epoll events we're currently registered for
+  uint32_t events;
+  // the client shut down its side; answer what it sent, then close
+  bool is_hung_up;
+
+  // switched to the shared memory transport: requests come from one ring
+  // and responses go to the other, and the socket is only kept to notice
+  // the client going away
+  bool is_shared;
+  SharedRing requests;
+  SharedRing responses;
+  // the client pokes `request_event_fd` when it's written requests or made
+  // room for responses; we poke `response_event_fd` the other way round
+  int request_event_fd;
+  int response_event_fd;
+
+  struct Server *server;
+  ucontext_t session_context;
+  char *session_stack;
+  // run_session has returned, and the connection should be closed
+  bool is_session_over;
+  // the session is partway through a request (waiting for its turn, say)
+  bool is_running_request;
+  // the connection's being closed; the session gives up when it's resumed
+  bool is_closing;
+  // the queue the session is waiting in, if any
+  SessionQueue *queue;
+  struct Connection *next_queued;
+  // the class of the statement the session is running
+  QueryClass query_class;
+  // set by the scheduler when it resumes the session for its turn
+  bool has_turn;
+  // rows the session's last turn went through, charged to its class
+  uint32_t turn_cost;
+  // has run since its output was last flushed
+  bool needs_flush;
+  struct Connection *next_to_flush;
+
+  ScanSlice slice;
+  // in the list of sessions waiting on their slice
+  struct Connection *next_running;
+
+  struct Connection *next;
+} Connection;
+
+typedef struct Server {
+  DB *db;
+  int epoll_fd;
+  int listen_fd;
+  Connection *connections;
+  // closed this round of events; freed once the round is over, since a
+  // later event in the same round may still point at them
+  Connection *closed_connections;
+  /*
+   * There's only one table and one transaction, so while a client has a
+   * transaction open everyone else's requests wait (unread in their input
+   * buffers) until it commits or rolls back.
+   */
+  Connection *transaction_owner;
+  bool is_transaction_over;
+  // inserts out on reader threads, and sessions whose BEGIN is waiting for
+  // them. Set once the last one is done
+  uint32_t num_running_appends;
+  uint32_t num_waiting_begins;
+  bool are_appends_over;
+
+  // where a session goes back to when it yields
+  ucontext_t loop_context;
+
+  // per class: sessions waiting for a turn, sessions waiting to be let in
+  // at all, how many statements are in (running or waiting for a turn),
+  // and the class's deficit for the deficit round robin
+  SessionQueue ready[NUM_QUERY_CLASSES];
+  SessionQueue admission[NUM_QUERY_CLASSES];
+  uint32_t num_admitted[NUM_QUERY_CLASSES];
+  int64_t deficits[NUM_QUERY_CLASSES];
+
+  // sessions that have run this time round the loop. Their output is sent
+  // once at the end of it, so everything a session produced over several
+  // turns goes out in one send
+  Connection *to_flush;
+
+  ReaderThread *readers;
+  uint32_t num_readers;
+  // the reader the next select gets pinned to
+  uint32_t next_reader;
+  // the reader threads poke this when they finish a slice
+  int slices_done_fd;
+  // sessions whose slice is on a reader thread
+  Connection *running_slices;
+} Server;
+
+#define LISTEN_BACKLOG 128
+#define MAX_EVENTS 64
+#define READ_SIZE 65536
+// stop reading from a client once this much input is waiting to run
+// (enough for the biggest request)
+#define INPUT_LIMIT (FRAME_HEADER_SIZE + MAX_FRAME_SIZE)
+// stop running a client's requests while this many bytes of responses
+// haven't been taken off our hands
+#define OUTPUT_LIMIT (256 * 1024)
+// the stack each session coroutine runs on, with a guard page at the
+// bottom. The deepest thing on it is a statement and a row batch
+#define SESSION_STACK_SIZE (64 * 1024)
+#define GUARD_PAGE_SIZE 4096
+// a select goes back into the queue after this many rows
+#define SESSION_SLICE_ROWS 256
+// at most this many selects are in progress at once; more wait their turn
+// to start. Point statements aren't limited
+#define MAX_ACTIVE_SCANS 4
+// more than there are selects in progress would just sit idle
+#define MAX_READER_THREADS 16
+// a reader thread answers at most this many inserts at once, after it's
+// flushed them (see run_reader_thread)
+#define MAX_UNFLUSHED_INSERTS 64
+// a prepare error quoting a longer statement than this gets cut short
+#define PREPARE_ERROR_MESSAGE_SIZE 256
+// what each class gets to spend, in rows, per round of the scheduler: a
+// full slice of a select, or 256 point statements
+#define CLASS_QUANTUM 256
+
+void buffer_reserve(Buffer *buffer, size_t extra) {
+  if (buffer->capacity - buffer->length >= extra) {
+    return;
+  }
+  size_t capacity = buffer->capacity * 2;
+  if (capacity < buffer->length + extra) {
+    capacity = buffer->length + extra;
+  }
+  buffer->data = realloc(buffer->data, capacity);
+  buffer->capacity = capacity;
+}
+
+void buffer_append(Buffer *buffer, const void *data, size_t length) {
+  // an empty buffer's data may still be NULL, which memcpy mustn't get
+  if (length == 0) {
+    return;
+  }
+  buffer_reserve(buffer, length);
+  memcpy(buffer->data + buffer->length, data, length);
+  buffer->length += length;
+}
+
+void append_frame_header(Buffer *output, ResponseType type,
+                         uint32_t payload_length) {
+  char header[FRAME_HEADER_SIZE];
+  put_u32(header, payload_length + 1);
+  header[4] = type;
+  buffer_append(output, header, FRAME_HEADER_SIZE);
+}
+
+void append_error(Buffer *output, const char *message) {
+  size_t length = strlen(message);
+  append_frame_header(output, RESPONSE_ERROR, length);
+  buffer_append(output, message, length);
+}
+
+void append_row(Buffer *output, Statement *statement) {
+  const char *username = db_column_text(statement, COLUMN_USERNAME);
+  const char *email = db_column_text(statement, COLUMN_EMAIL);
+  // both fit in a u8: they're at most 32 and 255 bytes
+  uint8_t username_length = strlen(username);
+  uint8_t email_length = strlen(email);
+
+  append_frame_header(output, RESPONSE_ROW,
+                      4 + 1 + username_length + 1 + email_length);
+  char id[4];
+  put_u32(id, db_column_int(statement, COLUMN_ID));
+  buffer_append(output, id, 4);
+  buffer_append(output, &username_length, 1);
+  buffer_append(output, username, username_length);
+  buffer_append(output, &email_length, 1);
+  buffer_append(output, email, email_length);
+}
+
+size_t align_8(size_t length) { return (length + 7) & ~(size_t)7; }
+
+// writes one Arrow-style string column: offsets, then the bytes
+char *put_string_column(char *out, const char **values,
+                        const uint8_t *lengths, uint32_t num_rows) {
+  uint32_t offset = 0;
+  put_u32(out, 0);
+  for (uint32_t i = 0; i < num_rows; i++) {
+    offset += lengths[i];
+    put_u32(out + 4 * (i + 1), offset);
+  }
+  out += align_8(4 * (num_rows + 1));
+
+  char *bytes = out;
+  for (uint32_t i = 0; i < num_rows; i++) {
+    memcpy(bytes, values[i], lengths[i]);
+    bytes += lengths[i];
+  }
+  return out + align_8(offset);
+}
+
+void append_batch(Buffer *output, RowBatch *batch) {
+  uint32_t num_rows = batch->num_rows;
+  uint8_t username_lengths[ROW_BATCH_SIZE];
+  uint8_t email_lengths[ROW_BATCH_SIZE];
+  size_t username_bytes = 0;
+  size_t email_bytes = 0;
+  for (uint32_t i = 0; i < num_rows; i++) {
+    username_lengths[i] = strlen(batch->usernames[i]);
+    email_lengths[i] = strlen(batch->emails[i]);
+    username_bytes += username_lengths[i];
+    email_bytes += email_lengths[i];
+  }
+
+  size_t offsets_size = align_8(4 * (num_rows + 1));
+  size_t payload_length = 8 + align_8(4 * num_rows) + offsets_size +
+                          align_8(username_bytes) + offsets_size +
+                          align_8(email_bytes);
+  append_frame_header(output, RESPONSE_BATCH, payload_length);
+
+  buffer_reserve(output, payload_length);
+  char *out = output->data + output->length;
+  // zeroes the padding
+  memset(out, 0, payload_length);
+  put_u32(out, num_rows);
+  out += 8;
+  for (uint32_t i = 0; i < num_rows; i++) {
+    put_u32(out + 4 * i, batch->ids[i]);
+  }
+  out += align_8(4 * num_rows);
+  out = put_string_column(out, batch->usernames, username_lengths, num_rows);
+  put_string_column(out, batch->emails, email_lengths, num_rows);
+  output->length += payload_length;
+}
+
+// the same messages the REPL prints, into `message`, which has room for
+// PREPARE_ERROR_MESSAGE_SIZE bytes. A long statement gets cut short
+void format_prepare_error(PrepareResult result, const char *sql,
+                          size_t sql_length, char *message) {
+  switch (result) {
+  case (PREPARE_NEGATIVE_ID):
+    strcpy(message, "ID must be positive.");
+    break;
+  case (PREPARE_ID_OUT_OF_RANGE):
+    strcpy(message, "ID is out of range.");
+    break;
+  case (PREPARE_STRING_TOO_LONG):
+    strcpy(message, "String is too long.");
+    break;
+  case (PREPARE_UNRECOGNIZED_STATEMENT):
+    snprintf(message, PREPARE_ERROR_MESSAGE_SIZE,
+             "Unrecognized keyword at start of '%.*s' .", (int)sql_length,
+             sql);
+    break;
+  default:
+    strcpy(message, "Syntax error. Could not parse statement.");
+    break;
+  }
+}
+
+const char *execute_error_message(ExecuteResult result) {
+  switch (result) {
+  case (EXECUTE_TABLE_FULL):
+    return "Error: Table full.";
+  case (EXECUTE_DUPLICATE_KEY):
+    return "Error: Duplicate key.";
+  case (EXECUTE_TRANSACTION_ALREADY_OPEN):
+    return "Error: Transaction already open.";
+  case (EXECUTE_NO_TRANSACTION):
+    return "Error: No transaction is open.";
+  case (EXECUTE_INTERRUPTED):
+    return "Error: Interrupted.";
+  case (EXECUTE_TIMED_OUT):
+    return "Error: Statement timed out.";
+  case (EXECUTE_READ_ONLY):
+    return "Error: Read only.";
+  default:
+    return NULL;
+  }
+}
+
+bool has_pending_output(Connection *connection) {
+  return connection->output_sent < connection->output.length;
+}
+
+size_t pending_output_length(Connection *connection) {
+  return connection->output.length - connection->output_sent;
+}
+
+// copies as much pending output as fits into the response ring
+size_t flush_output_to_ring(Connection *connection) {
+  size_t written = ring_write(&connection->responses,
+                              connection->output.data + connection->output_sent,
+                              connection->output.length -
+                                  connection->output_sent);
+  if (written > 0) {
+    signal_event(connection->response_event_fd);
+  }
+  return written;
+}
+
+// sends as much pending output as the socket (or ring) takes. false if
+// it's gone
+bool flush_output(Connection *connection) {
+  while (connection->is_shared && has_pending_output(connection)) {
+    size_t written = flush_output_to_ring(connection);
+    if (written == 0) {
+      // the client pokes us once it's read enough to make room
+      break;
+    }
+    connection->output_sent += written;
+  }
+  while (!connection->is_shared && has_pending_output(connection)) {
+    ssize_t sent = send(connection->fd,
+                        connection->output.data + connection->output_sent,
+                        pending_output_length(connection), MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        return false;
+      }
+      break;
+    }
+    connection->output_sent += sent;
+  }
+
+  // move what's left to the front, so the buffer doesn't keep growing
+  // while a session appends behind a slow reader
+  if (connection->output_sent > 0) {
+    memmove(connection->output.data,
+            connection->output.data + connection->output_sent,
+            pending_output_length(connection));
+    connection->output.length -= connection->output_sent;
+    connection->output_sent = 0;
+  }
+  return true;
+}
+
+// reads whatever has arrived, up to INPUT_LIMIT. false once the client
+// hangs up
+bool read_connection_input(Connection *connection) {
+  // drop the requests that have already run
+  Buffer *input = &connection->input;
+  if (connection->input_start > 0) {
+    memmove(input->data, input->data + connection->input_start,
+            input->length - connection->input_start);
+    input->length -= connection->input_start;
+    connection->input_start = 0;
+  }
+
+  while (input->length < INPUT_LIMIT) {
+    buffer_reserve(input, READ_SIZE);
+    ssize_t received = recv(connection->fd, input->data + input->length,
+                            READ_SIZE, 0);
+    if (received == 0) {
+      return false;
+    }
+    if (received < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    input->length += received;
+  }
+  return true;
+}
+
+// the requests that haven't been run yet. Shared memory requests are run
+// right where they sit in the ring
+const char *session_input(Connection *connection, size_t *length) {
+  if (connection->is_shared) {
+    return ring_read_pointer(&connection->requests, length);
+  }
+  *length = connection->input.length - connection->input_start;
+  if (connection->input.data == NULL) {
+    return NULL;
+  }
+  return connection->input.data + connection->input_start;
+}
+
+void consume_input(Connection *connection, size_t length) {
+  if (!connection->is_shared) {
+    connection->input_start += length;
+  } else if (ring_consume(&connection->requests, length)) {
+    // the client is waiting for room to write more requests
+    signal_event(connection->response_event_fd);
+  }
+}
+
+// the total length of the frame at the start of `input`, or 0 if it
+// hasn't all arrived yet. -1 for a length no client would send
+ssize_t complete_frame_length(const char *input, size_t length) {
+  if (length < FRAME_HEADER_SIZE) {
+    return 0;
+  }
+  uint32_t frame_length = get_u32(input);
+  if (frame_length == 0 || frame_length > MAX_FRAME_SIZE) {
+    return -1;
+  }
+  size_t total_length = 4 + (size_t)frame_length;
+  return length < total_length ? 0 : (ssize_t)total_length;
+}
+
+// true if the request after the running statement is a REQUEST_CANCEL for
+// it
+bool is_cancel_next(Connection *connection) {
+  size_t length;
+  const char *input = session_input(connection, &length);
+  return complete_frame_length(input, length) > 0 &&
+         input[4] == REQUEST_CANCEL;
+}
+
+bool is_waiting_on_transaction(Server *server, Connection *connection) {
+  return server->transaction_owner != NULL &&
+         server->transaction_owner != connection;
+}
+
+void close_fd(int *fd) {
+  if (*fd != -1) {
+    close(*fd);
+    *fd = -1;
+  }
+}
+
+/*
+ * Answers REQUEST_SHARED_MEMORY: makes the rings and the two eventfds and
+ * hands the client its copies of the fds along with the response frame.
+ * From here on the connection's requests and responses go through the
+ * rings.
+ */
+void switch_to_shared_memory(Server *server, Connection *connection) {
+  int memfd = memfd_create("db-rings", MFD_CLOEXEC);
+  connection->request_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  connection->response_event_fd = eventfd(0, EFD_CLOEXEC);
+  if (memfd == -1 || connection->request_event_fd == -1 ||
+      connection->response_event_fd == -1 ||
+      ftruncate(memfd, SHARED_MEMORY_SIZE) == -1 ||
+      !map_shared_rings(memfd, &connection->requests,
+                        &connection->responses)) {
+    close_fd(&memfd);
+    close_fd(&connection->request_event_fd);
+    close_fd(&connection->response_event_fd);
+    append_error(&connection->output, "Error: Could not share memory.");
+    return;
+  }
+
+  char frame[FRAME_HEADER_SIZE];
+  put_u32(frame, 1);
+  frame[4] = RESPONSE_SHARED_MEMORY;
+  struct iovec iov = {frame, FRAME_HEADER_SIZE};
+
+  int fds[3] = {memfd, connection->request_event_fd,
+                connection->response_event_fd};
+  char control[CMSG_SPACE(sizeof(fds))];
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(header), fds, sizeof(fds));
+
+  // nothing else is waiting to go out (see process_input), so these five
+  // bytes always fit in the socket's buffer
+  sendmsg(connection->fd, &message, MSG_NOSIGNAL);
+  // the mappings keep the memory alive
+  close(memfd);
+
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = connection;
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, connection->request_event_fd,
+            &event);
+  connection->is_shared = true;
+}
+
+void queue_push(SessionQueue *queue, Connection *connection) {
+  connection->queue = queue;
+  connection->next_queued = NULL;
+  if (queue->tail != NULL) {
+    queue->tail->next_queued = connection;
+  } else {
+    queue->head = connection;
+  }
+  queue->tail = connection;
+  queue->length += 1;
+}
+
+Connection *queue_pop(SessionQueue *queue) {
+  Connection *connection = queue->head;
+  queue->head = connection->next_queued;
+  if (queue->head == NULL) {
+    queue->tail = NULL;
+  }
+  queue->length -= 1;
+  connection->queue = NULL;
+  return connection;
+}
+
+// takes the connection out of whatever queue it's in
+void queue_remove(Connection *connection) {
+  SessionQueue *queue = connection->queue;
+  if (queue == NULL) {
+    return;
+  }
+  Connection *previous = NULL;
+  Connection *current = queue->head;
+  while (current != connection) {
+    previous = current;
+    current = current->next_queued;
+  }
+  if (previous != NULL) {
+    previous->next_queued = connection->next_queued;
+  } else {
+    queue->head = connection->next_queued;
+  }
+  if (queue->tail == connection) {
+    queue->tail = previous;
+  }
+  queue->length -= 1;
+  connection->queue = NULL;
+}
+
+/*
+ * Hands control back to the event loop until it resumes this session.
+ * Every caller re-checks whatever it was waiting for afterwards, since the
+ * loop resumes a session whenever something happens on its connection.
+ *
+ * Returns false if the connection is being closed: the session should
+ * clean up and return.
+ */
+bool session_yield(Connection *connection) {
+  swapcontext(&connection->session_context,
+              &connection->server->loop_context);
+  return !connection->is_closing;
+}
+
+// yields until the client has taken most of our output off our hands, or
+// asks to cancel the statement instead
+bool wait_for_output_room(Connection *connection) {
+  while (pending_output_length(connection) >= OUTPUT_LIMIT &&
+         !is_cancel_next(connection)) {
+    if (!session_yield(connection)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+uint32_t class_limit(QueryClass query_class) {
+  return query_class == QUERY_CLASS_SCAN ? MAX_ACTIVE_SCANS : UINT32_MAX;
+}
+
+/*
+ * Admission control: lets a statement of `query_class` in if its class has
+ * room, or else waits until one finishes (see release_statement). false
+ * if the connection was closed while waiting.
+ */
+bool admit_statement(Server *server, Connection *connection,
+                     QueryClass query_class) {
+  connection->query_class = query_class;
+  if (server->num_admitted[query_class] < class_limit(query_class)) {
+    server->num_admitted[query_class] += 1;
+    return true;
+  }
+
+  SessionQueue *admission = &server->admission[query_class];
+  queue_push(admission, connection);
+  while (connection->queue == admission) {
+    if (!session_yield(connection)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// a statement's done: makes room for the next one waiting to get in, which
+// goes straight into the ready queue
+void release_statement(Server *server, QueryClass query_class) {
+  server->num_admitted[query_class] -= 1;
+  SessionQueue *admission = &server->admission[query_class];
+  if (admission->length > 0) {
+    server->num_admitted[query_class] += 1;
+    queue_push(&server->ready[query_class], queue_pop(admission));
+  }
+}
+
+// queues the session up and yields until the scheduler gives it a turn.
+// false if the connection was closed while waiting
+bool wait_for_turn(Server *server, Connection *connection) {
+  if (connection->queue == NULL && !connection->has_turn) {
+    queue_push(&server->ready[connection->query_class], connection);
+  }
+  while (!connection->has_turn) {
+    if (!session_yield(connection)) {
+      return false;
+    }
+  }
+  connection->has_turn = false;
+  return true;
+}
+
+/*
+ * Steps the statement for up to SESSION_SLICE_ROWS rows, appending the
+ * responses to `output`. EXECUTE_ROW if the select has more rows to go.
+ */
+ExecuteResult run_slice(Statement *statement, bool is_columnar,
+                        Buffer *output, uint32_t *num_rows) {
+  ExecuteResult result = EXECUTE_ROW;
+  *num_rows = 0;
+  while (*num_rows < SESSION_SLICE_ROWS) {
+    if (is_columnar) {
+      RowBatch batch;
+      result = db_step_batch(statement, &batch);
+      if (result == EXECUTE_ROW) {
+        append_batch(output, &batch);
+        *num_rows += batch.num_rows;
+      }
+    } else {
+      result = db_step(statement);
+      if (result == EXECUTE_ROW) {
+        append_row(output, statement);
+        *num_rows += 1;
+      }
+    }
+    if (result != EXECUTE_ROW) {
+      break;
+    }
+  }
+  return result;
+}
+
+// flushes the reader's appends and lets the loop answer the inserts that
+// made them
+void finish_unflushed_inserts(ReaderThread *reader, ScanSlice *unflushed) {
+  db_flush(reader->db);
+  while (unflushed != NULL) {
+    // the loop may reuse the slice as soon as it's done
+    ScanSlice *next = unflushed->next;
+    __atomic_store_n(&unflushed->is_done, true, __ATOMIC_RELEASE);
+    unflushed = next;
+  }
+  signal_event(reader->slices_done_fd);
+}
+
+/*
+ * Runs slices handed to the reader until the server exits. An insert only
+ * goes in the appender's buffer (see db_open_appender), so it isn't
+ * answered until it's been flushed into the table; otherwise a client
+ * could get the go-ahead and not find its row. It's held back until there
+ * are no slices waiting or MAX_UNFLUSHED_INSERTS of them are, and then
+ * they're all flushed in one go.
+ */
+void *run_reader_thread(void *argument) {
+  ReaderThread *reader = argument;
+  ScanSlice *unflushed = NULL;
+  uint32_t num_unflushed = 0;
+  while (true) {
+    pthread_mutex_lock(&reader->lock);
+    if (reader->slices == NULL && unflushed != NULL) {
+      pthread_mutex_unlock(&reader->lock);
+      finish_unflushed_inserts(reader, unflushed);
+      unflushed = NULL;
+      num_unflushed = 0;
+      continue;
+    }
+    while (reader->slices == NULL) {
+      pthread_cond_wait(&reader->has_slices, &reader->lock);
+    }
+    ScanSlice *slice = reader->slices;
+    reader->slices = slice->next;
+    if (reader->slices == NULL) {
+      reader->last_slice = NULL;
+    }
+    pthread_mutex_unlock(&reader->lock);
+
+    slice->result = run_slice(slice->statement, slice->is_columnar,
+                              &slice->output, &slice->num_rows);
+    if (slice->statement->type == STATEMENT_INSERT) {
+      slice->next = unflushed;
+      unflushed = slice;
+      num_unflushed += 1;
+      if (num_unflushed == MAX_UNFLUSHED_INSERTS) {
+        finish_unflushed_inserts(reader, unflushed);
+        unflushed = NULL;
+        num_unflushed = 0;
+      }
+      continue;
+    }
+    __atomic_store_n(&slice->is_done, true, __ATOMIC_RELEASE);
+    signal_event(reader->slices_done_fd);
+  }
+  return NULL;
+}
+
+void remove_running_slice(Server *server, Connection *connection) {
+  Connection **link = &server->running_slices;
+  while (*link != connection) {
+    link = &(*link)->next_running;
+  }
+  *link = connection->next_running;
+}
+
+/*
+ * Hands the select's next slice to its reader thread and yields until
+ * it's done, so the loop gets on with everyone else in the meantime. Then
+ * the rows it produced go in the connection's output.
+ *
+ * Returns false if the connection was closed while it ran.
+ */
+bool run_slice_on_reader(Server *server, Connection *connection,
+                         ExecuteResult *result, uint32_t *num_rows) {
+  ScanSlice *slice = &connection->slice;
+  ReaderThread *reader = slice->reader;
+  slice->output.length = 0;
+  slice->is_done = false;
+  slice->next = NULL;
+
+  pthread_mutex_lock(&reader->lock);
+  if (reader->last_slice != NULL) {
+    reader->last_slice->next = slice;
+  } else {
+    reader->slices = slice;
+  }
+  reader->last_slice = slice;
+  pthread_cond_signal(&reader->has_slices);
+  pthread_mutex_unlock(&reader->lock);
+
+  connection->next_running = server->running_slices;
+  server->running_slices = connection;
+  // the rows are read on the reader thread; all this turn did on the loop
+  // was hand them over
+  connection->turn_cost = 1;
+
+  bool is_open = true;
+  while (!__atomic_load_n(&slice->is_done, __ATOMIC_ACQUIRE)) {
+    if (!session_yield(connection)) {
+      // the statement the reader is stepping is about to be finalized, so
+      // wait it out. It's only a slice
+      while (!__atomic_load_n(&slice->is_done, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+      }
+      is_open = false;
+    }
+  }
+  remove_running_slice(server, connection);
+  if (!is_open) {
+    return false;
+  }
+
+  buffer_append(&connection->output, slice->output.data,
+                slice->output.length);
+  *result = slice->result;
+  *num_rows = slice->num_rows;
+  return true;
+}
+
+/*
+ * Steps through a select (or runs any other statement), putting the
+ * responses in the connection's output. A select runs a slice of rows per
+ * turn; in between, other sessions get theirs and the loop sends what's
+ * been produced so far.
+ *
+ * Returns false if the connection was closed partway.
+ */
+bool run_statement(Server *server, Connection *connection,
+                   Statement *statement, bool is_columnar) {
+  QueryClass query_class = statement->type == STATEMENT_SELECT
+                               ? QUERY_CLASS_SCAN
+                               : QUERY_CLASS_POINT;
+  if (!admit_statement(server, connection, query_class)) {
+    db_finalize(statement);
+    return false;
+  }
+
+  Buffer *output = &connection->output;
+  ExecuteResult result = EXECUTE_ROW;
+  while (result == EXECUTE_ROW) {
+    if (!wait_for_turn(server, connection)) {
+      break;
+    }
+    if (is_cancel_next(connection)) {
+      db_cancel(statement);
+    }
+
+    uint32_t rows_in_slice;
+    if (connection->slice.reader != NULL) {
+      connection->slice.statement = statement;
+      connection->slice.is_columnar = is_columnar;
+      if (!run_slice_on_reader(server, connection, &result,
+                               &rows_in_slice)) {
+        result = EXECUTE_ROW;
+        break;
+      }
+    } else {
+      result = run_slice(statement, is_columnar, output, &rows_in_slice);
+      // a point statement costs the same as a one row slice
+      connection->turn_cost = rows_in_slice > 0 ? rows_in_slice : 1;
+    }
+
+    // a client that isn't reading its results shouldn't hold up everyone
+    // else's selects, so a scan gives up its place while it waits for the
+    // output to drain, and gets back in line after
+    if (result == EXECUTE_ROW &&
+        pending_output_length(connection) >= OUTPUT_LIMIT) {
+      release_statement(server, query_class);
+      if (!wait_for_output_room(connection) ||
+          !admit_statement(server, connection, query_class)) {
+        db_finalize(statement);
+        return false;
+      }
+    }
+  }
+  db_finalize(statement);
+  release_statement(server, query_class);
+  connection->slice.reader = NULL;
+  if (result == EXECUTE_ROW) {
+    // the connection was closed partway
+    return false;
+  }
+
+  if (result != EXECUTE_SUCCESS) {
+    append_error(output, execute_error_message(result));
+    return true;
+  }
+  append_frame_header(output, RESPONSE_DONE, 0);
+
+  if (statement->type == STATEMENT_BEGIN) {
+    server->transaction_owner = connection;
+  } else if (statement->type == STATEMENT_COMMIT ||
+             statement->type == STATEMENT_ROLLBACK) {
+    server->transaction_owner = NULL;
+    server->is_transaction_over = true;
+  }
+  return true;
+}
+
+/*
+ * Yields until no insert is out on a reader thread, for a BEGIN: once the
+ * transaction is open they'd wait on the reader thread for it to end (see
+ * db_open_appender). None get sent out from the moment a BEGIN starts
+ * waiting until it's run. false if the connection was closed while
+ * waiting.
+ */
+bool wait_for_appends(Server *server, Connection *connection) {
+  while (server->num_running_appends > 0) {
+    if (!session_yield(connection)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// runs the request frame at the start of the session's input, and takes
+// it off the input. false if the connection was closed partway
+bool run_session_request(Server *server, Connection *connection,
+                         const char *frame, size_t frame_length) {
+  const char *payload = frame + FRAME_HEADER_SIZE;
+  size_t payload_length = frame_length - FRAME_HEADER_SIZE;
+  char type = frame[4];
+
+  if (type == REQUEST_STATEMENT || type == REQUEST_STATEMENT_COLUMNAR) {
+    Statement statement;
+    PrepareResult prepare_result =
+        db_prepare(server->db, payload, payload_length, &statement);
+    // plain inserts go out to the reader threads too, while there's no
+    // transaction open or about to be. Appends only ever go at the end of
+    // the table, so while deletes have left holes, inserts stay here to
+    // fill them
+    bool is_append = prepare_result == PREPARE_SUCCESS &&
+                     statement.type == STATEMENT_INSERT &&
+                     !statement.is_upsert && server->num_readers > 0 &&
+                     server->transaction_owner == NULL &&
+                     server->num_waiting_begins == 0 &&
+                     !db_has_free_slot(server->db);
+    if (prepare_result == PREPARE_SUCCESS &&
+        ((statement.type == STATEMENT_SELECT && server->num_readers > 0 &&
+          server->transaction_owner != connection) ||
+         is_append)) {
+      // prepared again on a reader thread's handle, so that thread can
+      // step it. The transaction's own selects stay here, the only place
+      // its uncommitted rows can be seen from
+      ReaderThread *reader = &server->readers[server->next_reader];
+      server->next_reader = (server->next_reader + 1) % server->num_readers;
+      db_prepare(reader->db, payload, payload_length, &statement);
+      connection->slice.reader = reader;
+    }
+    bool is_begin = prepare_result == PREPARE_SUCCESS &&
+                    statement.type == STATEMENT_BEGIN;
+    if (is_begin) {
+      server->num_waiting_begins += 1;
+      if (!wait_for_appends(server, connection)) {
+        server->num_waiting_begins -= 1;
+        return false;
+      }
+    }
+    // the error message quotes the sql, so it's made before the request
+    // goes
+    char error_message[PREPARE_ERROR_MESSAGE_SIZE];
+    if (prepare_result != PREPARE_SUCCESS) {
+      format_prepare_error(prepare_result, payload, payload_length,
+                           error_message);
+    }
+    // the statement has its own copy of everything it needs from the sql,
+    // so the request can go before it runs
+    consume_input(connection, frame_length);
+    if (prepare_result != PREPARE_SUCCESS) {
+      append_error(&connection->output, error_message);
+      return true;
+    }
+
+    if (is_append) {
+      server->num_running_appends += 1;
+    }
+    bool is_open = run_statement(server, connection, &statement,
+                                 type == REQUEST_STATEMENT_COLUMNAR);
+    if (is_begin) {
+      server->num_waiting_begins -= 1;
+    }
+    if (is_append) {
+      server->num_running_appends -= 1;
+      if (server->num_running_appends == 0 &&
+          server->num_waiting_begins > 0) {
+        server->are_appends_over = true;
+      }
+    }
+    return is_open;
+  }
+
+  consume_input(connection, frame_length);
+  if (type == REQUEST_CANCEL) {
+    // it was for the statement before it, which is done by now
+    return true;
+  }
+  if (type == REQUEST_SHARED_MEMORY && !connection->is_shared) {
+    // the fds have to go out ahead of anything else, so wait for the
+    // earlier responses to be sent first
+    while (has_pending_output(connection)) {
+      if (!session_yield(connection)) {
+        return false;
+      }
+    }
+    switch_to_shared_memory(server, connection);
+    // anything after it on the socket is ignored
+    return true;
+  }
+  append_error(&connection->output, "Unrecognized request.");
+  return true;
+}
+
+// set just before a session's first resume, since makecontext can only
+// pass ints to the function it starts
+Connection *starting_connection;
+
+/*
+ * A client's whole session: wait for a complete request (and for no one
+ * else to be in a transaction), run it, repeat. Returns (to the event
+ * loop) when the connection is closed or the client sends garbage.
+ */
+void run_session(void) {
+  Connection *connection = starting_connection;
+  Server *server = connection->server;
+
+  bool is_open = true;
+  while (is_open) {
+    size_t input_length;
+    const char *input = session_input(connection, &input_length);
+    ssize_t frame_length = complete_frame_length(input, input_length);
+
+    if (frame_length < 0) {
+      is_open = false;
+    } else if (frame_length == 0 ||
+               is_waiting_on_transaction(server, connection)) {
+      is_open = session_yield(connection);
+    } else {
+      connection->is_running_request = true;
+      is_open =
+          run_session_request(server, connection, input, frame_length) &&
+          !connection->is_closing;
+      connection->is_running_request = false;
+    }
+  }
+  connection->is_session_over = true;
+}
+
+bool start_session(Server *server, Connection *connection) {
+  char *stack = mmap(NULL, SESSION_STACK_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (stack == MAP_FAILED) {
+    return false;
+  }
+  // running off the end of the stack faults instead of scribbling over
+  // whatever's mapped below it
+  mprotect(stack, GUARD_PAGE_SIZE, PROT_NONE);
+
+  connection->session_stack = stack;
+  getcontext(&connection->session_context);
+  connection->session_context.uc_stack.ss_sp = stack;
+  connection->session_context.uc_stack.ss_size = SESSION_STACK_SIZE;
+  // returning from run_session lands back in the loop
+  connection->session_context.uc_link = &server->loop_context;
+  makecontext(&connection->session_context, run_session, 0);
+
+  starting_connection = connection;
+  swapcontext(&server->loop_context, &connection->session_context);
+  return true;
+}
+
+// a hung up client is done once it's been sent everything it asked for
+bool is_finished(Connection *connection) {
+  size_t input_length;
+  const char *input = session_input(connection, &input_length);
+  return connection->is_hung_up && !connection->is_running_request &&
+         !has_pending_output(connection) &&
+         complete_frame_length(input, input_length) <= 0;
+}
+
+// registers for reading while there's room for more input, and for
+// writing only while there's output waiting
+void update_events(Server *server, Connection *connection) {
+  uint32_t events = 0;
+  // a shared memory connection's eventfd is registered for reading on its
+  // own, and its output is flushed whenever the client makes room
+  if (!connection->is_shared) {
+    size_t input_length = connection->input.length - connection->input_start;
+    if (!connection->is_hung_up && input_length < INPUT_LIMIT) {
+      events |= EPOLLIN;
+    }
+    if (has_pending_output(connection)) {
+      events |= EPOLLOUT;
+    }
+  }
+  if (events == connection->events) {
+    return;
+  }
+
+  struct epoll_event event;
+  event.events = events;
+  event.data.ptr = connection;
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+  connection->events = events;
+}
+
+void close_connection(Server *server, Connection *connection) {
+  // let a session that's partway through a statement finalize it
+  if (!connection->is_session_over) {
+    connection->is_closing = true;
+    swapcontext(&server->loop_context, &connection->session_context);
+  }
+  queue_remove(connection);
+
+  // a client that disconnects mid-transaction doesn't get to keep it
+  if (server->transaction_owner == connection) {
+    Statement statement;
+    db_prepare(server->db, "rollback", 8, &statement);
+    db_step(&statement);
+    db_finalize(&statement);
+    server->transaction_owner = NULL;
+    server->is_transaction_over = true;
+  }
+
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+  close(connection->fd);
+  if (connection->is_shared) {
+    // the client holds the same eventfd open, which would keep it in our
+    // epoll set after we close it, so it has to be taken out by hand
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, connection->request_event_fd,
+              NULL);
+    close(connection->request_event_fd);
+    close(connection->response_event_fd);
+    unmap_shared_rings(&connection->requests, &connection->responses);
+  }
+
+  Connection **link = &server->connections;
+  while (*link != connection) {
+    link = &(*link)->next;
+  }
+  *link = connection->next;
+
+  connection->fd = -1;
+  connection->next = server->closed_connections;
+  server->closed_connections = connection;
+}
+
+void free_closed_connections(Server *server) {
+  while (server->closed_connections != NULL) {
+    Connection *connection = server->closed_connections;
+    server->closed_connections = connection->next;
+    munmap(connection->session_stack, SESSION_STACK_SIZE);
+    free(connection->input.data);
+    free(connection->output.data);
+    free(connection->slice.output.data);
+    free(connection);
+  }
+}
+
+// lets the session run until it next has to wait
+void resume_session(Server *server, Connection *connection) {
+  if (connection->fd == -1) {
+    return;
+  }
+  swapcontext(&server->loop_context, &connection->session_context);
+
+  if (connection->is_session_over) {
+    close_connection(server, connection);
+  } else if (!connection->needs_flush) {
+    connection->needs_flush = true;
+    connection->next_to_flush = server->to_flush;
+    server->to_flush = connection;
+  }
+}
+
+// sends what the sessions that ran produced
+void flush_sessions(Server *server) {
+  while (server->to_flush != NULL) {
+    Connection *connection = server->to_flush;
+    server->to_flush = connection->next_to_flush;
+    connection->needs_flush = false;
+    if (connection->fd == -1) {
+      continue;
+    }
+
+    if (!flush_output(connection) || is_finished(connection)) {
+      close_connection(server, connection);
+    } else {
+      update_events(server, connection);
+    }
+  }
+}
+
+void accept_connections(Server *server) {
+  while (true) {
+    int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+    if (fd == -1) {
+      return;
+    }
+
+    Connection *connection = calloc(1, sizeof(Connection));
+    connection->fd = fd;
+    connection->events = EPOLLIN;
+    connection->request_event_fd = -1;
+    connection->response_event_fd = -1;
+    connection->server = server;
+    if (!start_session(server, connection)) {
+      close(fd);
+      free(connection);
+      continue;
+    }
+    connection->next = server->connections;
+    server->connections = connection;
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = connection;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+  }
+}
+
+// picks up the sessions that were held back by a transaction that's over,
+// or by inserts on reader threads that a BEGIN was waiting out
+void resume_waiting_connections(Server *server) {
+  while (server->is_transaction_over || server->are_appends_over) {
+    server->is_transaction_over = false;
+    server->are_appends_over = false;
+
+    Connection *connection = server->connections;
+    while (connection != NULL) {
+      Connection *next = connection->next;
+      resume_session(server, connection);
+      connection = next;
+    }
+  }
+}
+
+/*
+ * Deficit round robin over the classes' ready queues. Each round, every
+ * class with sessions waiting gets CLASS_QUANTUM rows of credit, and its
+ * sessions take turns (one slice each) for as long as the credit lasts.
+ * The rows a turn went through are charged to its class, so a queue full
+ * of scans and a queue full of point lookups get the same share of work,
+ * and the lookups get through 256 statements in the time one scan slice
+ * takes.
+ *
+ * A class with nothing waiting doesn't bank its credit.
+ */
+void run_scheduled_sessions(Server *server) {
+  for (int query_class = 0; query_class < NUM_QUERY_CLASSES; query_class++) {
+    SessionQueue *ready = &server->ready[query_class];
+    if (ready->length == 0) {
+      server->deficits[query_class] = 0;
+      continue;
+    }
+    server->deficits[query_class] += CLASS_QUANTUM;
+
+    while (ready->length > 0 && server->deficits[query_class] > 0) {
+      Connection *connection = queue_pop(ready);
+      connection->has_turn = true;
+      connection->turn_cost = 1;
+      resume_session(server, connection);
+      server->deficits[query_class] -= connection->turn_cost;
+      resume_waiting_connections(server);
+    }
+  }
+}
+
+// resumes the sessions whose slices the reader threads have finished
+void finish_slices(Server *server) {
+  uint64_t count;
+  (void)!read(server->slices_done_fd, &count, sizeof(count));
+
+  Connection *connection = server->running_slices;
+  while (connection != NULL) {
+    // resuming takes the session out of the list
+    Connection *next = connection->next_running;
+    if (__atomic_load_n(&connection->slice.is_done, __ATOMIC_ACQUIRE)) {
+      resume_session(server, connection);
+    }
+    connection = next;
+  }
+}
+
+bool has_scheduled_sessions(Server *server) {
+  for (int query_class = 0; query_class < NUM_QUERY_CLASSES; query_class++) {
+    if (server->ready[query_class].length > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void handle_event(Server *server, Connection *connection, uint32_t events) {
+  if (connection->fd == -1) {
+    return;
+  }
+
+  // gone completely, so there's no one left to answer
+  if (events & (EPOLLHUP | EPOLLERR)) {
+    close_connection(server, connection);
+    return;
+  }
+
+  if (connection->is_shared) {
+    // only a wakeup; what's new is in the rings
+    uint64_t count;
+    (void)!read(connection->request_event_fd, &count, sizeof(count));
+  } else if ((events & EPOLLIN) && !read_connection_input(connection)) {
+    connection->is_hung_up = true;
+  }
+  if (!flush_output(connection)) {
+    close_connection(server, connection);
+    return;
+  }
+  resume_session(server, connection);
+}
+
+int open_listen_socket(const char *socket_path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    return -1;
+  }
+  strcpy(address.sun_path, socket_path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  // a socket file left behind by an earlier server would make bind fail
+  unlink(socket_path);
+  if (bind(fd, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+      listen(fd, LISTEN_BACKLOG) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// starts up to `num_readers` reader threads. false if it couldn't
+bool start_readers(Server *server, uint32_t num_readers) {
+  server->readers = NULL;
+  server->num_readers = 0;
+  server->next_reader = 0;
+  server->running_slices = NULL;
+  server->slices_done_fd = -1;
+  if (num_readers == 0) {
+    return true;
+  }
+  if (num_readers > MAX_READER_THREADS) {
+    num_readers = MAX_READER_THREADS;
+  }
+
+  server->slices_done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (server->slices_done_fd == -1) {
+    return false;
+  }
+  server->readers = calloc(num_readers, sizeof(ReaderThread));
+  for (uint32_t i = 0; i < num_readers; i++) {
+    ReaderThread *reader = &server->readers[i];
+    reader->db = db_open_appender(server->db);
+    if (reader->db == NULL) {
+      break;
+    }
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->has_slices, NULL);
+    reader->slices_done_fd = server->slices_done_fd;
+    // they run for as long as the server does
+    if (pthread_create(&reader->thread, NULL, run_reader_thread, reader) !=
+        0) {
+      db_close(reader->db);
+      break;
+    }
+    server->num_readers += 1;
+  }
+  return server->num_readers > 0;
+}
+
+bool run_server(DB *db, const char *socket_path, uint32_t num_readers) {
+  Server server;
+  server.db = db;
+  server.connections = NULL;
+  server.closed_connections = NULL;
+  memset(server.ready, 0, sizeof(server.ready));
+  memset(server.admission, 0, sizeof(server.admission));
+  memset(server.num_admitted, 0, sizeof(server.num_admitted));
+  memset(server.deficits, 0, sizeof(server.deficits));
+  server.transaction_owner = NULL;
+  server.is_transaction_over = false;
+  server.num_running_appends = 0;
+  server.num_waiting_begins = 0;
+  server.are_appends_over = false;
+  server.to_flush = NULL;
+
+  server.listen_fd = open_listen_socket(socket_path);
+  if (server.listen_fd == -1) {
+    printf("Unable to listen on '%s'\n", socket_path);
+    return false;
+  }
+  if (!start_readers(&server, num_readers)) {
+    printf("Unable to start reader threads\n");
+    return false;
+  }
+
+  server.epoll_fd = epoll_create1(0);
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  // the listening socket is the one event without a connection
+  event.data.ptr = NULL;
+  epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &event);
+  if (server.num_readers > 0) {
+    // and the readers' eventfd is the other
+    event.data.ptr = &server.slices_done_fd;
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.slices_done_fd, &event);
+  }
+
+  struct epoll_event events[MAX_EVENTS];
+  while (true) {
+    // don't sleep while there are sessions waiting for their turn
+    int timeout = has_scheduled_sessions(&server) ? 0 : -1;
+    int num_events = epoll_wait(server.epoll_fd, events, MAX_EVENTS, timeout);
+    for (int i = 0; i < num_events; i++) {
+      if (events[i].data.ptr == NULL) {
+        accept_connections(&server);
+      } else if (events[i].data.ptr == &server.slices_done_fd) {
+        finish_slices(&server);
+      } else {
+        handle_event(&server, events[i].data.ptr, events[i].events);
+      }
+      resume_waiting_connections(&server);
+    }
+    run_scheduled_sessions(&server);
+    flush_sessions(&server);
+    // flushing can close a connection, and with it a transaction
+    resume_waiting_connections(&server);
+    flush_sessions(&server);
+    free_closed_connections(&server);
+  }
+}
+
+#else
+
+// epoll is Linux only
+bool run_server(DB *db, const char *socket_path, uint32_t num_readers) {
+  (void)db;
+  (void)socket_path;
+  (void)num_readers;
+  printf("Server mode is only supported on Linux.\n");
+  return false;
+}
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "db.h"
+
+/*
+ * Server mode (./db -s /tmp/db.sock): one process owns the table and any
+ * number of clients talk to it over a Unix domain socket, instead of each
+ * of them running its own ./db with its own copy of the data.
+ *
+ * Everything sent either way is a frame:
+ *
+ *   length (u32) | type (u8) | payload (length - 1 bytes)
+ *
+ * with integers little-endian and `length` counting the type byte too.
+ *
+ * A client sends REQUEST_STATEMENT frames whose payload is a statement,
+ * written just like at the REPL prompt. For each one the server answers
+ * with one RESPONSE_ROW per row (selects only), then RESPONSE_DONE, or
+ * with a single RESPONSE_ERROR whose payload is the error message.
+ *
+ * Requests can be pipelined: a client may send as many as it likes without
+ * waiting, and the answers come back in the order the requests were sent.
+ * It can even shut down its writing side once it's sent everything and
+ * still read all the answers.
+ *
+ * An empty REQUEST_CANCEL stops a select that's running away: it cancels
+ * the statement sent right before it, if that's still running, which then
+ * ends with a RESPONSE_ERROR instead of RESPONSE_DONE. The cancel itself
+ * never gets an answer. It's picked up as soon as it arrives, while the
+ * statement is still going, even if the client isn't reading the rows.
+ *
+ * A row payload is
+ *
+ *   id (u32) | username length (u8) | username | email length (u8) | email
+ *
+ * REQUEST_STATEMENT_COLUMNAR is the same, except a select's rows come back
+ * a batch at a time as RESPONSE_BATCH frames laid out the way Arrow lays
+ * out its buffers, so a client can use the columns as they are instead of
+ * decoding rows:
+ *
+ *   num_rows (u32) | 4 bytes of padding
+ *   ids               num_rows x u32
+ *   username offsets  (num_rows + 1) x i32
+ *   username bytes    row i is bytes offsets[i] to offsets[i + 1]
+ *   email offsets     (num_rows + 1) x i32
+ *   email bytes
+ *
+ * with each of the five buffers zero-padded to a multiple of 8 bytes.
+ *
+ * A client on the same machine can skip the socket after connecting: it
+ * sends an empty REQUEST_SHARED_MEMORY, and gets back an empty
+ * RESPONSE_SHARED_MEMORY carrying three fds (SCM_RIGHTS): a memfd with a
+ * request ring and a response ring in it (see shared_memory.h), an eventfd
+ * to wake the server and one the server wakes the client with. After that
+ * the same frames go through the rings instead, and the socket only stays
+ * open so the server notices when the client goes away.
+ *
+ * A client pokes the server's eventfd after writing requests, and after
+ * reading responses when ring_consume says the server is waiting for room.
+ */
+#define FRAME_HEADER_SIZE 5
+// anything bigger is a broken client; the connection gets dropped
+#define MAX_FRAME_SIZE (1 << 20)
+
+typedef enum {
+  REQUEST_STATEMENT = 1,
+  REQUEST_SHARED_MEMORY = 2,
+  REQUEST_STATEMENT_COLUMNAR = 3,
+  REQUEST_CANCEL = 4
+} RequestType;
+typedef enum {
+  RESPONSE_ROW = 1,
+  RESPONSE_DONE = 2,
+  RESPONSE_ERROR = 3,
+  RESPONSE_SHARED_MEMORY = 4,
+  RESPONSE_BATCH = 5
+} ResponseType;
+
+// little-endian integers in frames
+void put_u32(char *out, uint32_t value);
+uint32_t get_u32(const char *in);
+
+// serves clients on `socket_path` until killed, running selects on
+// `num_readers` threads of their own (0 runs everything on one thread).
+// false if the socket couldn't be set up
+bool run_server(DB *db, const char *socket_path, uint32_t num_readers);
+
+#endif
@@ -0,0 +1,107 @@
+#include "shared_memory.h"
+
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * Reserves twice the ring's size of address space, then maps the ring's
+ * part of the memfd into both halves. Byte i and byte i + SHARED_RING_SIZE
+ * are then the same memory.
+ */
+char *map_ring_twice(int memfd, off_t offset) {
+  char *data = mmap(NULL, 2 * SHARED_RING_SIZE, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (data == MAP_FAILED) {
+    return NULL;
+  }
+
+  for (int i = 0; i < 2; i++) {
+    void *half = mmap(data + i * SHARED_RING_SIZE, SHARED_RING_SIZE,
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, memfd,
+                      offset);
+    if (half == MAP_FAILED) {
+      munmap(data, 2 * SHARED_RING_SIZE);
+      return NULL;
+    }
+  }
+  return data;
+}
+
+bool map_shared_rings(int memfd, SharedRing *requests, SharedRing *responses) {
+  SharedRingState *states =
+      mmap(NULL, SHARED_STATES_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+           memfd, 0);
+  if (states == MAP_FAILED) {
+    return false;
+  }
+  requests->state = &states[0];
+  responses->state = &states[1];
+
+  requests->data = map_ring_twice(memfd, SHARED_STATES_SIZE);
+  responses->data =
+      map_ring_twice(memfd, SHARED_STATES_SIZE + SHARED_RING_SIZE);
+  if (requests->data == NULL || responses->data == NULL) {
+    unmap_shared_rings(requests, responses);
+    return false;
+  }
+  return true;
+}
+
+void unmap_shared_rings(SharedRing *requests, SharedRing *responses) {
+  if (requests->data != NULL) {
+    munmap(requests->data, 2 * SHARED_RING_SIZE);
+  }
+  if (responses->data != NULL) {
+    munmap(responses->data, 2 * SHARED_RING_SIZE);
+  }
+  munmap(requests->state, SHARED_STATES_SIZE);
+}
+
+/*
+ * The other process's index is read with acquire and ours is published
+ * with release, so the bytes written before a tail moves are visible to
+ * whoever sees the new tail (and likewise for head and the room it frees).
+ */
+const char *ring_read_pointer(SharedRing *ring, size_t *length) {
+  uint64_t head = ring->state->head;
+  uint64_t tail = __atomic_load_n(&ring->state->tail, __ATOMIC_ACQUIRE);
+  *length = tail - head;
+  return ring->data + head % SHARED_RING_SIZE;
+}
+
+bool ring_consume(SharedRing *ring, size_t length) {
+  __atomic_store_n(&ring->state->head, ring->state->head + length,
+                   __ATOMIC_SEQ_CST);
+  // pairs with the writer setting the flag and then re-checking for room:
+  // either it sees the room we just made or we see its flag
+  return __atomic_exchange_n(&ring->state->is_writer_waiting, 0,
+                             __ATOMIC_SEQ_CST);
+}
+
+size_t ring_write(SharedRing *ring, const char *data, size_t length) {
+  uint64_t tail = ring->state->tail;
+  uint64_t head = __atomic_load_n(&ring->state->head, __ATOMIC_ACQUIRE);
+  size_t room = SHARED_RING_SIZE - (tail - head);
+
+  if (room < length) {
+    __atomic_store_n(&ring->state->is_writer_waiting, 1, __ATOMIC_SEQ_CST);
+    head = __atomic_load_n(&ring->state->head, __ATOMIC_SEQ_CST);
+    room = SHARED_RING_SIZE - (tail - head);
+  }
+  if (length > room) {
+    length = room;
+  }
+
+  // thanks to the double mapping this never needs splitting at the end
+  memcpy(ring->data + tail % SHARED_RING_SIZE, data, length);
+  __atomic_store_n(&ring->state->tail, tail + length, __ATOMIC_RELEASE);
+  return length;
+}
+
+void signal_event(int event_fd) {
+  uint64_t one = 1;
+  // can only fail if the counter is about to overflow, and then the reader
+  // is getting woken up anyway
+  (void)!write(event_fd, &one, sizeof(one));
+}
@@ -0,0 +1,61 @@
+#ifndef SHARED_MEMORY_H
+#define SHARED_MEMORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Ring buffers in memory shared between the server and a client on the
+ * same machine, so frames can be handed over without a socket syscall or a
+ * trip through the kernel's buffers.
+ *
+ * One memfd holds both directions:
+ *
+ *   ring states (one page) | request ring | response ring
+ *
+ * Each ring has exactly one writer and one reader. The writer only moves
+ * `tail` and the reader only moves `head`; both only ever grow, and
+ * `tail - head` is how much is waiting to be read.
+ *
+ * Every ring is mapped twice, back to back, so whatever is waiting in it
+ * is always one contiguous run of bytes, even when it wraps around the
+ * end. A reader can parse a frame right where it sits.
+ */
+#define SHARED_RING_SIZE (1 << 20)
+#define SHARED_STATES_SIZE 4096
+#define SHARED_MEMORY_SIZE (SHARED_STATES_SIZE + 2 * SHARED_RING_SIZE)
+
+typedef struct {
+  // head and tail on their own cache lines, since each is written from a
+  // different process
+  uint64_t head;
+  char head_padding[56];
+  uint64_t tail;
+  char tail_padding[56];
+  // set by a writer that found the ring full, so the reader knows to wake
+  // it up once it's made room
+  uint32_t is_writer_waiting;
+} SharedRingState;
+
+typedef struct {
+  SharedRingState *state;
+  char *data;
+} SharedRing;
+
+// maps the rings of `memfd`. false if mmap fails
+bool map_shared_rings(int memfd, SharedRing *requests, SharedRing *responses);
+void unmap_shared_rings(SharedRing *requests, SharedRing *responses);
+
+// the bytes waiting to be read, contiguous, and how many there are
+const char *ring_read_pointer(SharedRing *ring, size_t *length);
+// marks `length` bytes as read. true if the writer is waiting for the room
+bool ring_consume(SharedRing *ring, size_t length);
+
+// writes up to `length` bytes and returns how many fit
+size_t ring_write(SharedRing *ring, const char *data, size_t length);
+
+// wakes up the other side through its eventfd
+void signal_event(int event_fd);
+
+#endif
@@ -1,7 +1,11 @@
+require 'socket'
+require 'tempfile'
+require 'tmpdir'
+
 describe 'database' do
-  def run_script(commands)
+  def run_script(commands, *options)
     raw_output = nil
-    IO.popen("./db", "r+") do |pipe|
+    IO.popen(["./db", *options], "r+") do |pipe|
       commands.each do |command|
         pipe.puts command
       end
@@ -14,6 +18,68 @@ describe 'database' do
     raw_output.split("\n")
   end
 
+  def run_script_file(commands)
+    file = Tempfile.new(["script", ".sql"])
+    file.write(commands.join("\n"))
+    file.close
+    IO.popen(["./db", "-f", file.path], &:read).split("\n")
+  ensure
+    file.unlink
+  end
+
+  def with_data_file(lines, extension = ".csv")
+    file = Tempfile.new(["data", extension])
+    file.write(lines.join("\n") + "\n")
+    file.close
+    yield file.path
+  ensure
+    file.unlink
+  end
+
+  def with_server(*options)
+    Dir.mktmpdir do |dir|
+      socket_path = File.join(dir, "db.sock")
+      pid = spawn("./db", "-s", socket_path, *options)
+      begin
+        sleep 0.01 until File.socket?(socket_path)
+        yield socket_path
+      ensure
+        Process.kill("TERM", pid)
+        Process.wait(pid)
+      end
+    end
+  end
+
+  # sends one statement frame; see server.h for the framing
+  def send_statement(socket, sql)
+    socket.write([sql.bytesize + 1, 1].pack("VC") + sql)
+  end
+
+  # reads the frames answering one statement, as rows and a final status
+  def read_response(socket)
+    responses = []
+    loop do
+      length, type = socket.read(5).unpack("VC")
+      payload = socket.read(length - 1)
+      case type
+      when 1
+        id, username_length = payload.unpack("VC")
+        username = payload[5, username_length]
+        email = payload[6 + username_length..]
+        responses << [id, username, email]
+      when 2
+        return responses << :done
+      when 3
+        return responses << payload
+      end
+    end
+  end
+
+  def execute(socket, sql)
+    send_statement(socket, sql)
+    read_response(socket)
+  end
+
   it 'inserts and retrieves a row' do
     result = run_script([
       "insert 1 user1 person1@example.com",
@@ -74,14 +140,783 @@ describe 'database' do
   it 'prints an error message if id is negative' do
     script = [
       "insert -1 cstack foo@bar.com",
+      "insert -0 cstack foo@bar.com",
       "select",
       ".exit",
     ]
     result = run_script(script)
     expect(result).to match_array([
       "db > ID must be positive.",
+      "db > ID must be positive.",
+      "db > Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'keeps rows inserted in a committed transaction' do
+    script = [
+      "begin",
+      "insert 1 user1 person1@example.com",
+      "insert 2 user2 person2@example.com",
+      "commit",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result).to match_array([
+      "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > (1, user1, person1@example.com)",
+      "(2, user2, person2@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'discards rows inserted in a rolled back transaction' do
+    script = (1..20).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script = ["insert 0 user0 person0@example.com", "begin"] + script
+    script += ["rollback", "select", ".exit"]
+    result = run_script(script)
+    expect(result[-4]).to eq("db > Executed.")
+    expect(result[-3]).to eq("db > (0, user0, person0@example.com)")
+    expect(result[-2]).to eq("Executed.")
+  end
+
+  it 'prints an error message for commit without begin' do
+    script = [
+      "commit",
+      "begin",
+      "begin",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result).to match_array([
+      "db > Error: No transaction is open.",
+      "db > Executed.",
+      "db > Error: Transaction already open.",
+      "db > ",
+    ])
+  end
+
+  it 'updates a row in place' do
+    script = [
+      "insert 1 user1 person1@example.com",
+      "insert 2 user2 person2@example.com",
+      "update set username = bob, email = bob@example.com where id = 2",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result).to match_array([
+      "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > (1, user1, person1@example.com)",
+      "(2, bob, bob@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'updates to values with punctuation in them' do
+    script = [
+      "insert 1 user1 person1@example.com",
+      "update set email = a-b(c) where id = 1",
+      "select",
+      "update set username = x=y, email = d;e where id = 1",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result).to eq([
+      "db > Executed.",
+      "db > Executed.",
+      "db > (1, user1, a-b(c))",
+      "Executed.",
+      "db > Executed.",
+      "db > (1, x=y, d;e)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'does not return deleted rows' do
+    script = (1..30).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script += (1..29).map { |i| "delete where id = #{i}" }
+    script += ["select", ".exit"]
+    result = run_script(script)
+    expect(result[-3]).to eq("db > (30, user30, person30@example.com)")
+    expect(result[-2]).to eq("Executed.")
+  end
+
+  it 'undoes a delete when the transaction rolls back' do
+    script = [
+      "insert 1 user1 person1@example.com",
+      "begin",
+      "delete where id = 1",
+      "rollback",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result[-3]).to eq("db > (1, user1, person1@example.com)")
+  end
+
+  it 'prints an error message for a malformed where clause' do
+    script = [
+      "delete where username = 1",
+      "update set id = 2 where id = 1",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result).to match_array([
+      "db > Syntax error. Could not parse statement.",
+      "db > Syntax error. Could not parse statement.",
+      "db > ",
+    ])
+  end
+
+  it 'reuses the slots of deleted rows' do
+    script = (1..1400).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script += [
+      "delete where id = 5",
+      "insert 1401 user1401 person1401@example.com",
+      "insert 1402 user1402 person1402@example.com",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result[-3]).to eq("db > Executed.")
+    expect(result[-2]).to eq("db > Error: Table full.")
+  end
+
+  it 'fills the hole left by a delete before appending' do
+    script = [
+      "insert 1 user1 person1@example.com",
+      "insert 2 user2 person2@example.com",
+      "insert 3 user3 person3@example.com",
+      "delete where id = 2",
+      "insert 4 user4 person4@example.com",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result[-5..-2]).to eq([
+      "db > (1, user1, person1@example.com)",
+      "(4, user4, person4@example.com)",
+      "(3, user3, person3@example.com)",
+      "Executed.",
+    ])
+  end
+
+  it 'compacts the table on vacuum' do
+    script = [
+      "insert 1 user1 person1@example.com",
+      "insert 2 user2 person2@example.com",
+      "insert 3 user3 person3@example.com",
+      "delete where id = 1",
+      ".vacuum",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result[-4..-2]).to eq([
+      "db > db > (3, user3, person3@example.com)",
+      "(2, user2, person2@example.com)",
+      "Executed.",
+    ])
+  end
+
+  it 'keeps every live row across vacuum steps' do
+    script = (1..100).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script += (2..100).step(2).map { |i| "delete where id = #{i}" }
+    script += [".vacuum", "select", ".exit"]
+    result = run_script(script)
+    rows = result[-52..-3].map { |line| line.gsub("db > ", "") }
+    expect(rows).to match_array((1..100).step(2).map do |i|
+      "(#{i}, user#{i}, person#{i}@example.com)"
+    end)
+  end
+
+  it 'prints an error message for a duplicate id' do
+    script = [
+      "insert 1 user1 person1@example.com",
+      "insert 1 user1 person1@example.com",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result).to match_array([
+      "db > Executed.",
+      "db > Error: Duplicate key.",
+      "db > (1, user1, person1@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'upserts with insert or replace and on conflict do update' do
+    script = [
+      "insert 1 user1 person1@example.com",
+      "insert or replace 1 bob bob@example.com",
+      "insert or replace 2 user2 person2@example.com",
+      "insert 2 alice alice@example.com on conflict(id) do update",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result).to match_array([
+      "db > Executed.",
       "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > (1, bob, bob@example.com)",
+      "(2, alice, alice@example.com)",
+      "Executed.",
       "db > ",
     ])
   end
+
+  it 'finds rows by id after they have been moved by vacuum' do
+    script = (1..300).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script += (1..150).map { |i| "delete where id = #{i}" }
+    script += [
+      ".vacuum",
+      "update set username = moved where id = 300",
+      "delete where id = 299",
+      "insert 299 again299 again299@example.com",
+      "insert 300 user300 person300@example.com",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result).to include(
+      "db > Error: Duplicate key.",
+      "db > (300, moved, person300@example.com)",
+      "(299, again299, again299@example.com)",
+    )
+  end
+
+  it 'runs a script file without prompts or acknowledgements' do
+    result = run_script_file([
+      "insert 1 user1 person1@example.com",
+      "insert 1 user1 person1@example.com",
+      "",
+      "insert 2 user2 person2@example.com",
+      "select",
+    ])
+    expect(result).to eq([
+      "Error: Duplicate key.",
+      "(1, user1, person1@example.com)",
+      "(2, user2, person2@example.com)",
+    ])
+  end
+
+  it 'stops a script file at .exit' do
+    result = run_script_file([
+      "insert 1 user1 person1@example.com",
+      ".exit",
+      "select",
+    ])
+    expect(result).to eq([])
+  end
+
+  it 'prints an error message if id does not fit' do
+    script = [
+      "insert 2147483648 user1 person1@example.com",
+      "insert 12abc user1 person1@example.com",
+      "insert 2147483647 user1 person1@example.com",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result).to match_array([
+      "db > ID is out of range.",
+      "db > Syntax error. Could not parse statement.",
+      "db > Executed.",
+      "db > (2147483647, user1, person1@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'keeps punctuation inside inserted values' do
+    script = [
+      "insert 1 a,b(c)=d person1@example.com",
+      "update set email=x@example.com where id=1",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result[-3]).to eq("db > (1, a,b(c)=d, x@example.com)")
+  end
+
+  it 'splits statements on tabs and runs of spaces' do
+    long_email = "a" * 100 + "@example.com"
+    script = [
+      "insert\t1   user1 \t #{long_email}",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result[-3]).to eq("db > (1, user1, #{long_email})")
+  end
+
+  it 'imports rows from a csv file' do
+    rows = (1..500).map { |i| "#{i},user#{i},person#{i}@example.com" }
+    with_data_file(rows) do |path|
+      result = run_script([
+        ".import #{path}",
+        "insert 500 user500 person500@example.com",
+        "select",
+        ".exit",
+      ])
+      expect(result[0]).to eq("db > Imported 500 rows.")
+      expect(result[1]).to eq("db > Error: Duplicate key.")
+      expect(result[2]).to eq("db > (1, user1, person1@example.com)")
+      expect(result[-3]).to eq("(500, user500, person500@example.com)")
+    end
+  end
+
+  it 'imports tab separated files' do
+    with_data_file(["1\tuser 1\tperson1@example.com"], ".tsv") do |path|
+      result = run_script([".import #{path}", "select", ".exit"])
+      expect(result[1]).to eq("db > (1, user 1, person1@example.com)")
+    end
+  end
+
+  it 'imports nothing when a csv row is invalid' do
+    rows = [
+      "1,user1,person1@example.com",
+      "",
+      "2,user2",
+      "3,user3,person3@example.com",
+    ]
+    with_data_file(rows) do |path|
+      result = run_script([".import #{path}", "select", ".exit"])
+      expect(result).to eq([
+        "db > Error: Could not parse line 3 of '#{path}'.",
+        "db > Executed.",
+        "db > ",
+      ])
+    end
+  end
+
+  it 'rolls back an import with the transaction' do
+    rows = (1..40).map { |i| "#{i},user#{i},person#{i}@example.com" }
+    with_data_file(rows) do |path|
+      result = run_script([
+        "insert 100 user100 person100@example.com",
+        "begin",
+        ".import #{path}",
+        "rollback",
+        "select",
+        ".exit",
+      ])
+      expect(result[-3]).to eq("db > (100, user100, person100@example.com)")
+    end
+  end
+
+  it 'exports rows that import back the same' do
+    rows = (1..300).map { |i| "#{i},user#{i},person#{i}@example.com" }
+    with_data_file(rows) do |path|
+      export = Tempfile.new(["export", ".csv"])
+      export.close
+      result = run_script([
+        ".import #{path}",
+        "delete where id = 7",
+        ".export #{export.path}",
+        ".exit",
+      ])
+      expect(result[2]).to eq("db > Exported 299 rows.")
+      expect(File.read(export.path).lines.map(&:chomp)).to eq(rows - [rows[6]])
+
+      result = run_script([".import #{export.path}", ".exit"])
+      expect(result[0]).to eq("db > Imported 299 rows.")
+    ensure
+      export.unlink
+    end
+  end
+
+  it 'exports the raw pages in binary mode' do
+    export = Tempfile.new(["export", ".bin"])
+    export.close
+    result = run_script([
+      "insert 1 user1 person1@example.com",
+      ".export binary #{export.path}",
+      ".exit",
+    ])
+    expect(result[1]).to eq("db > Exported 1 rows.")
+    data = File.binread(export.path)
+    expect(data[0, 8]).to eq("TAEPAGES")
+    expect(data.bytesize).to eq(16 + 4096)
+  ensure
+    export.unlink
+  end
+
+  it 'splits the table into partitions by id' do
+    # more rows than one table holds
+    script = (1..2000).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script += [
+      "insert 7 again again@example.com",
+      "update set username = seven where id = 7",
+      "delete where id = 8",
+      "begin",
+      "insert 2001 user2001 person2001@example.com",
+      "rollback",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script, "-p", "4")
+    expect(result).to include("db > Error: Duplicate key.")
+    ids = result.map { |line| line[/\((\d+), /, 1] }.compact.map(&:to_i)
+    expect(ids).to match_array((1..2000).to_a - [8])
+    updated = "(7, seven, person7@example.com)"
+    expect(result.any? { |line| line.end_with?(updated) }).to eq(true)
+  end
+
+  it 'refuses reader threads on a partitioned table' do
+    output = IO.popen(["./db", "-p", "4", "-s", "/tmp/unused.sock", "-r", "2"],
+                      &:read)
+    expect(output).to eq(
+      "Error: Reader threads aren't supported on a partitioned table.\n"
+    )
+  end
+
+  # runs a select big enough to fill the pipe and doesn't read its rows
+  # until the block has run, so the select is still going when it does
+  def run_blocked_select(setup = [])
+    IO.popen("./db", "r+") do |pipe|
+      setup.each { |command| pipe.puts command }
+      (1..1300).each { |i| pipe.puts "insert #{i} user#{i} #{"e" * 255}" }
+      pipe.puts "select"
+      sleep 0.5
+      yield pipe
+      pipe.puts "select"
+      pipe.puts ".exit"
+      pipe.close_write
+      pipe.read.split("\n")
+    end
+  end
+
+  it 'stops a running select on ctrl-c and keeps the table' do
+    output = run_blocked_select do |pipe|
+      Process.kill("INT", pipe.pid)
+    end
+    expect($?.success?).to eq(true)
+
+    expect(output).to include("Error: Interrupted.")
+    stopped_at = output.index("Error: Interrupted.")
+    rows_before = output[0...stopped_at].count { |line| line.include?("(") }
+    expect(rows_before < 1300).to eq(true)
+    # the select after it isn't affected
+    expect(output[stopped_at + 1..].count { |line| line.include?("(") })
+      .to eq(1300)
+  end
+
+  it 'times out a select that runs too long' do
+    output = run_blocked_select([".timeout 100"]) {}
+    expect(output).to include("Error: Statement timed out.")
+  end
+
+  it 'serves clients that share one table over a socket' do
+    with_server do |socket_path|
+      writer = UNIXSocket.new(socket_path)
+      reader = UNIXSocket.new(socket_path)
+      expect(execute(writer, "insert 1 user1 person1@example.com"))
+        .to eq([:done])
+      expect(execute(reader, "select")).to eq([
+        [1, "user1", "person1@example.com"],
+        :done,
+      ])
+      expect(execute(reader, "insert 1 user1 person1@example.com"))
+        .to eq(["Error: Duplicate key."])
+      expect(execute(reader, "insert foo")).to eq([
+        "Syntax error. Could not parse statement.",
+      ])
+      expect(execute(reader, "drop table")).to eq([
+        "Unrecognized keyword at start of 'drop table' .",
+      ])
+    end
+  end
+
+  it 'holds other clients back while a transaction is open' do
+    with_server do |socket_path|
+      owner = UNIXSocket.new(socket_path)
+      other = UNIXSocket.new(socket_path)
+      expect(execute(owner, "begin")).to eq([:done])
+      send_statement(other, "select")
+      execute(owner, "insert 1 user1 person1@example.com")
+      expect(IO.select([other], nil, nil, 0.1)).to eq(nil)
+
+      # hanging up rolls the transaction back and lets the select run
+      owner.close
+      expect(read_response(other)).to eq([:done])
+    end
+  end
+
+  it 'answers pipelined statements in order' do
+    with_server do |socket_path|
+      socket = UNIXSocket.new(socket_path)
+      statements = (1..200).map do |i|
+        "insert #{i} user#{i} person#{i}@example.com"
+      end
+      statements << "insert 1 user1 person1@example.com" << "select"
+      statements.each { |sql| send_statement(socket, sql) }
+      # the client can hang up its side and still get every answer
+      socket.close_write
+
+      responses = statements.map { read_response(socket) }
+      expect(responses[0...200].uniq).to eq([[:done]])
+      expect(responses[200]).to eq(["Error: Duplicate key."])
+      expect(responses[201].length).to eq(201)
+      expect(responses[201][199])
+        .to eq([200, "user200", "person200@example.com"])
+      expect(socket.read).to eq("")
+    end
+  end
+
+  it 'runs statements from a client over shared memory' do
+    with_server do |socket_path|
+      commands = (1..100).map do |i|
+        "insert #{i} user#{i} person#{i}@example.com"
+      end
+      commands += ["insert 1 a b", "select", ".exit"]
+      result = IO.popen(["./db", "-c", socket_path], "r+") do |pipe|
+        commands.each { |command| pipe.puts command }
+        pipe.close_write
+        pipe.read
+      end.split("\n")
+      expect(result[100]).to eq("db > Error: Duplicate key.")
+      expect(result[101]).to eq("db > (1, user1, person1@example.com)")
+      expect(result[-2]).to eq("Executed.")
+
+      # the same table is there for clients on the socket
+      socket = UNIXSocket.new(socket_path)
+      expect(execute(socket, "select").length).to eq(101)
+    end
+  end
+
+  it 'sends select results in columnar batches' do
+    with_server do |socket_path|
+      socket = UNIXSocket.new(socket_path)
+      (1..100).each do |i|
+        execute(socket, "insert #{i} user#{i} person#{i}@example.com")
+      end
+
+      sql = "select"
+      socket.write([sql.bytesize + 1, 3].pack("VC") + sql)
+      batches = []
+      loop do
+        length, type = socket.read(5).unpack("VC")
+        payload = socket.read(length - 1)
+        break if type == 2
+        num_rows = payload.unpack1("V")
+        ids = payload[8, 4 * num_rows].unpack("V*")
+        offsets_at = 8 + (4 * num_rows + 7) / 8 * 8
+        offsets = payload[offsets_at, 4 * (num_rows + 1)].unpack("l<*")
+        bytes_at = offsets_at + (4 * (num_rows + 1) + 7) / 8 * 8
+        usernames = (0...num_rows).map do |i|
+          payload[bytes_at + offsets[i], offsets[i + 1] - offsets[i]]
+        end
+        batches << [ids, usernames]
+      end
+
+      expect(batches.length).to eq(2)
+      expect(batches.flat_map(&:first)).to eq((1..100).to_a)
+      expect(batches[1][1].last).to eq("user100")
+    end
+  end
+
+  it 'runs selects on reader threads while writes go on' do
+    with_server("-r", "2") do |socket_path|
+      writer = UNIXSocket.new(socket_path)
+      (1..500).each do |i|
+        send_statement(writer, "insert #{i} user#{i} person#{i}@example.com")
+      end
+      500.times { read_response(writer) }
+
+      readers = (1..3).map { UNIXSocket.new(socket_path) }
+      readers.each { |reader| 5.times { send_statement(reader, "select") } }
+      (501..700).each do |i|
+        send_statement(writer, "insert #{i} user#{i} person#{i}@example.com")
+      end
+      send_statement(writer, "update set email = new@example.com where id = 1")
+      expect((0..200).map { read_response(writer) }.uniq).to eq([[:done]])
+
+      readers.each do |reader|
+        5.times do
+          rows = read_response(reader)
+          expect(rows.last).to eq(:done)
+          # however far the writes had got, every earlier row is there
+          expect(rows[0...500].map(&:first)).to eq((1..500).to_a)
+          expect(rows[1]).to eq([2, "user2", "person2@example.com"])
+        end
+      end
+      rows = execute(writer, "select")
+      expect(rows.length).to eq(701)
+      expect(rows[0]).to eq([1, "user1", "new@example.com"])
+    end
+  end
+
+  it 'runs inserts from many clients at once on reader threads' do
+    with_server("-r", "2") do |socket_path|
+      clients = (0...4).map { UNIXSocket.new(socket_path) }
+      clients.each_with_index do |client, k|
+        (0...200).each do |i|
+          id = i * 4 + k + 1
+          send_statement(client,
+                         "insert #{id} user#{id} person#{id}@example.com")
+        end
+        send_statement(client, "insert 1 again again@example.com")
+      end
+      # a transaction in the middle of it all
+      owner = UNIXSocket.new(socket_path)
+      expect(execute(owner, "begin")).to eq([:done])
+      expect(execute(owner, "insert 801 user801 person801@example.com"))
+        .to eq([:done])
+      expect(execute(owner, "commit")).to eq([:done])
+
+      clients.each do |client|
+        responses = (0..200).map { read_response(client) }
+        expect(responses[0...200].uniq).to eq([[:done]])
+        expect(responses[200]).to eq(["Error: Duplicate key."])
+      end
+      rows = execute(owner, "select")
+      expect(rows.last).to eq(:done)
+      expect(rows[0...-1].map(&:first).sort).to eq((1..801).to_a)
+      expect(rows).to include([1, "user1", "person1@example.com"])
+    end
+  end
+
+  it 'fills the table from two appenders' do
+    with_server("-r", "2") do |socket_path|
+      # enough clients that both appenders have rows buffered as the table
+      # runs out of room
+      clients = (0...10).map { UNIXSocket.new(socket_path) }
+      (0...130).each do |i|
+        clients.each_with_index do |client, k|
+          id = i * 10 + k + 1
+          send_statement(client, "insert #{id} user#{id} a@example.com")
+        end
+      end
+      clients.each do |client|
+        expect((1..130).map { read_response(client) }.uniq).to eq([[:done]])
+      end
+      expect(execute(clients[0], "insert 1301 user1301 a@example.com"))
+        .to eq(["Error: Table full."])
+      rows = execute(clients[1], "select")
+      expect(rows[0...-1].map(&:first).sort).to eq((1..1300).to_a)
+    end
+  end
+
+  it 'reuses the space deletes free up under reader threads' do
+    with_server("-r", "2") do |socket_path|
+      client = UNIXSocket.new(socket_path)
+      2.times do |round|
+        (1..1300).each do |i|
+          id = round * 5000 + i
+          send_statement(client, "insert #{id} user#{id} a@example.com")
+        end
+        expect((1..1300).map { read_response(client) }.uniq).to eq([[:done]])
+        expect(execute(client, "select").length).to eq(1301)
+
+        (1..1300).each do |i|
+          send_statement(client, "delete where id = #{round * 5000 + i}")
+        end
+        expect((1..1300).map { read_response(client) }.uniq).to eq([[:done]])
+        expect(execute(client, "select")).to eq([:done])
+      end
+      expect(execute(client, "insert 5000 a b")).to eq([:done])
+      expect(execute(client, "select")).to eq([[5000, "a", "b"], :done])
+    end
+  end
+
+  it 'shows a select the table as it was when it started' do
+    with_server do |socket_path|
+      writer = UNIXSocket.new(socket_path)
+      (1..1290).each do |i|
+        send_statement(writer, "insert #{i} user#{i} #{"e" * 255}")
+      end
+      1290.times { read_response(writer) }
+
+      # two of these are more than the socket and the server's buffer hold,
+      # so the second is partway through when the writes below come in
+      reader = UNIXSocket.new(socket_path)
+      2.times { send_statement(reader, "select") }
+      sleep 0.2
+      expect(execute(writer, "delete where id = 1290")).to eq([:done])
+      expect(execute(writer, "update set username = new where id = 1289"))
+        .to eq([:done])
+      expect(execute(writer, "insert 1291 user1291 user1291@example.com"))
+        .to eq([:done])
+
+      2.times do
+        rows = read_response(reader)
+        expect(rows.length).to eq(1291)
+        expect(rows[-3..]).to eq([
+          [1289, "user1289", "e" * 255],
+          [1290, "user1290", "e" * 255],
+          :done,
+        ])
+      end
+      rows = execute(writer, "select")
+      expect(rows.length).to eq(1291)
+      expect(rows).to include([1289, "new", "e" * 255])
+      expect(rows).to include([1291, "user1291", "user1291@example.com"])
+    end
+  end
+
+  it 'stops a select when the client cancels it' do
+    with_server do |socket_path|
+      socket = UNIXSocket.new(socket_path)
+      (1..100).each do |i|
+        execute(socket, "insert #{i} user#{i} person#{i}@example.com")
+      end
+
+      cancel = [1, 4].pack("VC")
+      socket.write([7, 1].pack("VC") + "select" + cancel)
+      expect(read_response(socket)).to eq(["Error: Interrupted."])
+
+      # a cancel for a statement that's already done is ignored
+      send_statement(socket, "delete where id = 1")
+      socket.write(cancel)
+      expect(read_response(socket)).to eq([:done])
+      expect(execute(socket, "select").length).to eq(100)
+    end
+  end
+
+  it 'keeps serving other clients while one is stuck on a big result' do
+    with_server do |socket_path|
+      # more of them than there are selects allowed to run at once
+      slow_clients = (1..6).map { UNIXSocket.new(socket_path) }
+      fast = UNIXSocket.new(socket_path)
+      (1..1000).each do |i|
+        send_statement(fast, "insert #{i} user#{i} #{"e" * 200}")
+      end
+      1000.times { read_response(fast) }
+
+      # far more output than the socket holds, and never read
+      slow_clients.each do |slow|
+        30.times { send_statement(slow, "select") }
+      end
+      expect(execute(fast, "insert 1001 user1001 person1001@example.com"))
+        .to eq([:done])
+      expect(execute(fast, "select").length).to eq(1002)
+    end
+  end
 end